@@ -0,0 +1,475 @@
+/*
+    (C) Copyright 2011, Stephen M. Cameron.
+
+    This file is part of explodomatica.
+
+    explodomatica is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    explodomatica is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with explodomatica; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+/*
+ * Times each stage of libexplodomatica on its own, and explodomatica()
+ * as a whole, over a range of durations, layer counts and reflection
+ * counts, and writes the results to stdout as JSON.  The stages are
+ * static functions, so libexplodomatica.c is built into this program
+ * rather than linked.  Anything the library prints goes to /dev/null.
+ *
+ * For each case, "samples" is the number of input samples the stage
+ * works on (for explodomatica(), the duration in samples), "ns_per_sample"
+ * and "mb_per_s" are worked out from that and the best of the repeated
+ * runs, and "peak_rss_kb" is the process's peak so far.  The realtime
+ * stage plays an explosion through the realtime engine, 1024 samples
+ * at a time, as an audio callback would; its "samples" are the samples
+ * played, and making the engine is not timed.
+ *
+ * --snr-reference and --snr check the float32 build against the double
+ * one instead ("make snr-test" does both): the double build writes its
+ * renders of some fixed seeds to a file, and the float32 build renders
+ * the same seeds, prints each one's signal to noise ratio against the
+ * reference, and fails if any is below the 96 dB of 16 bit output.
+ */
+#include "libexplodomatica.c"
+
+#include <time.h>
+#include <getopt.h>
+#include <sys/resource.h>
+
+struct bench {
+	struct explodomatica_context *ctx;	/* stage buffers */
+	struct explodomatica_context *render;	/* for explodomatica() */
+	struct explosion_def e;
+	struct sound *a, *b;
+	struct explodomatica_realtime *rt;	/* made by the first run */
+	int nsamples;
+	unsigned long long key;
+};
+
+struct bench_stage {
+	const char *name;
+	int sweep_layers;	/* run for each layer count? */
+	int sweep_refls;	/* run for each reflection count? */
+	int (*run)(struct bench *b);	/* returns samples worked on */
+};
+
+static int run_make_noise(struct bench *b)
+{
+	make_noise(&b->e, b->a, b->key++, b->nsamples);
+	return b->nsamples;
+}
+
+static int run_sliding_low_pass(struct bench *b)
+{
+	sliding_low_pass(b->a, b->e.lowpass_biquad, 3, 0.5, 0.25, NULL);
+	return b->nsamples;
+}
+
+static int run_change_speed(struct bench *b)
+{
+	struct arena_mark m = arena_mark(b->ctx);
+
+	change_speed(b->ctx, &b->e, b->a, b->e.final_speed_factor);
+	arena_release(b->ctx, m);
+	return b->nsamples;
+}
+
+static int run_renormalize(struct bench *b)
+{
+	renormalize(b->a);
+	return b->nsamples;
+}
+
+static int run_accumulate_sound(struct bench *b)
+{
+	accumulate_sound(b->a, b->b);
+	return b->nsamples;
+}
+
+static int run_accumulate_view(struct bench *b)
+{
+	struct sound_view v;
+
+	v = delayed_view(b->b, seconds_to_frames(b->e.preexplosion_delay));
+	accumulate_view_and_renormalize(b->a, &v);
+	return b->nsamples;
+}
+
+static int run_poor_mans_reverb(struct bench *b)
+{
+	struct arena_mark m = arena_mark(b->ctx);
+
+	poor_mans_reverb(b->ctx, &b->e, b->a);
+	arena_release(b->ctx, m);
+	return b->nsamples;
+}
+
+static int run_realtime(struct bench *b)
+{
+	float out[1024];
+	int n = 0, k;
+
+	if (!b->rt)
+		b->rt = explodomatica_realtime_new(&b->e);
+	explodomatica_realtime_trigger(b->rt, b->key++);
+	do {
+		k = explodomatica_realtime_render(b->rt, out, ARRAYSIZE(out));
+		n += k;
+	} while (k == (int) ARRAYSIZE(out));
+	return n;
+}
+
+static int run_explodomatica(struct bench *b)
+{
+	b->e.seed = (long long) b->key++;
+	b->e.context = b->render;
+	explodomatica(&b->e);
+	return b->nsamples;
+}
+
+static struct bench_stage stages[] = {
+	{ "make_noise", 0, 0, run_make_noise },
+	{ "sliding_low_pass", 0, 0, run_sliding_low_pass },
+	{ "change_speed", 0, 0, run_change_speed },
+	{ "renormalize", 0, 0, run_renormalize },
+	{ "accumulate_sound", 0, 0, run_accumulate_sound },
+	{ "accumulate_view", 0, 0, run_accumulate_view },
+	{ "poor_mans_reverb", 0, 1, run_poor_mans_reverb },
+	{ "realtime", 1, 1, run_realtime },
+	{ "explodomatica", 1, 1, run_explodomatica },
+};
+
+static const double durations[] = { 1.0, 4.0, 16.0 };
+static const int layers[] = { 1, 4, 8 };
+static const int refls[][2] = { { 10, 50 }, { 20, 100 }, { 40, 200 } };
+
+static int repeat = 3;
+static int quick = 0;
+static const char *only_stage = NULL;
+static FILE *out;
+static int ncases = 0;
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double) t.tv_sec + (double) t.tv_nsec * 1e-9;
+}
+
+static long peak_rss_kb(void)
+{
+	struct rusage u;
+
+	if (getrusage(RUSAGE_SELF, &u) != 0)
+		return -1;
+	return u.ru_maxrss;
+}
+
+static void setup(struct bench *b, double duration, int nlayers,
+		int early, int late)
+{
+	struct explosion_def defaults = EXPLOSION_DEF_DEFAULTS;
+
+	b->e = defaults;
+	b->e.duration = duration;
+	b->e.nlayers = nlayers;
+	b->e.reverb_early_refls = early;
+	b->e.reverb_late_refls = late;
+	b->nsamples = seconds_to_frames(duration);
+	b->key = 1;
+	explodomatica_realtime_free(b->rt);
+	b->rt = NULL;
+
+	arena_reset(b->ctx, 2 * sound_bytes(b->nsamples));
+	b->a = alloc_sound(b->ctx, b->nsamples);
+	b->b = alloc_sound(b->ctx, b->nsamples);
+	make_noise(&b->e, b->a, b->key++, b->nsamples);
+	make_noise(&b->e, b->b, b->key++, b->nsamples);
+}
+
+static void bench_case(struct bench *b, struct bench_stage *s,
+		double duration, int nlayers, int early, int late)
+{
+	double t, best = 0.0, total = 0.0;
+	int i, n = 0;
+
+	setup(b, duration, nlayers, early, late);
+	s->run(b);	/* warm up, and let the arena grow */
+	for (i = 0; i < repeat; i++) {
+		t = now();
+		n = s->run(b);
+		t = now() - t;
+		total += t;
+		if (i == 0 || t < best)
+			best = t;
+	}
+
+	fprintf(out, "%s\n    { \"stage\": \"%s\", \"duration\": %g, ",
+		ncases++ ? "," : "", s->name, duration);
+	if (s->sweep_layers)
+		fprintf(out, "\"layers\": %d, ", nlayers);
+	else
+		fprintf(out, "\"layers\": null, ");
+	if (s->sweep_refls)
+		fprintf(out, "\"early_refls\": %d, \"late_refls\": %d, ", early, late);
+	else
+		fprintf(out, "\"early_refls\": null, \"late_refls\": null, ");
+	fprintf(out, "\"samples\": %d, \"best_seconds\": %.9f, \"mean_seconds\": %.9f, "
+		"\"ns_per_sample\": %.3f, \"mb_per_s\": %.1f, \"peak_rss_kb\": %ld }",
+		n, best, total / repeat, best * 1e9 / n,
+		n * sizeof(sample_t) / best / 1e6, peak_rss_kb());
+	fflush(out);
+}
+
+static void bench_stage(struct bench *b, struct bench_stage *s)
+{
+	struct explosion_def defaults = EXPLOSION_DEF_DEFAULTS;
+	int nd, nl, nr, d, l, r;
+
+	nd = quick ? 2 : ARRAYSIZE(durations);
+	nl = quick || !s->sweep_layers ? 1 : ARRAYSIZE(layers);
+	nr = quick || !s->sweep_refls ? 1 : ARRAYSIZE(refls);
+
+	/* every duration and layer count, at the default reflections ... */
+	for (d = 0; d < nd; d++)
+		for (l = 0; l < nl; l++)
+			bench_case(b, s, durations[d],
+				s->sweep_layers && !quick ? layers[l] : defaults.nlayers,
+				refls[0][0], refls[0][1]);
+	/* ... then the other reflection counts, at the default duration */
+	for (r = 1; r < nr; r++)
+		bench_case(b, s, defaults.duration, defaults.nlayers,
+				refls[r][0], refls[r][1]);
+}
+
+static const long long snr_seeds[] = { 3, 11, 1234567 };
+#define SNR_FLOOR_DB 96.0
+
+static struct sound *snr_render(struct bench *b, long long seed)
+{
+	struct explosion_def defaults = EXPLOSION_DEF_DEFAULTS;
+	struct sound *s;
+
+	b->e = defaults;
+	b->e.seed = seed;
+	b->e.context = b->render;
+	s = explodomatica(&b->e);
+	if (!s)
+		fprintf(stderr, "bench_explodomatica: seed %lld did not render\n", seed);
+	return s;
+}
+
+static int snr_reference(struct bench *b, const char *filename)
+{
+	struct sound *s;
+	unsigned int i;
+	double x;
+	FILE *f;
+	int j;
+
+	if (sizeof(sample_t) != sizeof(double)) {
+		fprintf(stderr, "bench_explodomatica: --snr-reference needs "
+			"the double build\n");
+		return 1;
+	}
+	f = fopen(filename, "w");
+	if (!f) {
+		fprintf(stderr, "bench_explodomatica: cannot open '%s': %s\n",
+			filename, strerror(errno));
+		return 1;
+	}
+	for (i = 0; i < ARRAYSIZE(snr_seeds); i++) {
+		s = snr_render(b, snr_seeds[i]);
+		if (!s) {
+			fclose(f);
+			return 1;
+		}
+		fwrite(&s->nsamples, sizeof(s->nsamples), 1, f);
+		for (j = 0; j < s->nsamples; j++) {
+			x = s->data[j];
+			fwrite(&x, sizeof(x), 1, f);
+		}
+		fprintf(out, "seed %lld: %d samples\n", snr_seeds[i], s->nsamples);
+	}
+	if (ferror(f) | fclose(f)) {
+		fprintf(stderr, "bench_explodomatica: cannot write '%s'\n", filename);
+		return 1;
+	}
+	return 0;
+}
+
+static int snr_compare(struct bench *b, const char *filename)
+{
+	double x, d, signal, noise, snr;
+	struct sound *s;
+	unsigned int i;
+	int j, n, failed = 0;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (!f) {
+		fprintf(stderr, "bench_explodomatica: cannot open '%s': %s\n",
+			filename, strerror(errno));
+		return 1;
+	}
+	for (i = 0; i < ARRAYSIZE(snr_seeds); i++) {
+		s = snr_render(b, snr_seeds[i]);
+		if (!s) {
+			fclose(f);
+			return 1;
+		}
+		if (fread(&n, sizeof(n), 1, f) != 1)
+			goto short_file;
+		/* samples past the end of either render count as noise */
+		signal = noise = 0.0;
+		for (j = 0; j < n || j < s->nsamples; j++) {
+			x = 0.0;
+			if (j < n && fread(&x, sizeof(x), 1, f) != 1)
+				goto short_file;
+			d = (j < s->nsamples ? s->data[j] : 0.0) - x;
+			signal += x * x;
+			noise += d * d;
+		}
+		snr = noise > 0.0 ? 10.0 * log10(signal / noise) : INFINITY;
+		fprintf(out, "seed %lld: SNR %.1f dB", snr_seeds[i], snr);
+		if (n != s->nsamples)
+			fprintf(out, ", %d samples against %d", s->nsamples, n);
+		fprintf(out, "%s\n", snr < SNR_FLOOR_DB ? ", below the 16 bit floor" : "");
+		if (snr < SNR_FLOOR_DB)
+			failed = 1;
+	}
+	if (fread(&x, sizeof(x), 1, f) == 1) {
+		fprintf(stderr, "bench_explodomatica: '%s' is longer than "
+			"the renders\n", filename);
+		failed = 1;
+	}
+	fclose(f);
+	return failed;
+
+short_file:
+	fprintf(stderr, "bench_explodomatica: '%s' is too short for seed %lld\n",
+		filename, snr_seeds[i]);
+	fclose(f);
+	return 1;
+}
+
+static void usage(void)
+{
+	unsigned int i;
+
+	fprintf(stderr, "usage: bench_explodomatica [options] > results.json\n");
+	fprintf(stderr, "options:\n");
+	fprintf(stderr, "  --repeat n      Times each case n times, and reports the best\n");
+	fprintf(stderr, "                  Default is %d\n", repeat);
+	fprintf(stderr, "  --quick         Fewer, shorter cases\n");
+	fprintf(stderr, "  --stage name    Only times the named stage, one of:\n");
+	for (i = 0; i < ARRAYSIZE(stages); i++)
+		fprintf(stderr, "                  %s\n", stages[i].name);
+	fprintf(stderr, "  --snr-reference file\n");
+	fprintf(stderr, "                  Instead of timing, writes renders of some fixed\n");
+	fprintf(stderr, "                  seeds to file.  Needs the double build.\n");
+	fprintf(stderr, "  --snr file      Instead of timing, renders the same seeds and\n");
+	fprintf(stderr, "                  prints their SNR against file, failing below %g dB\n",
+		SNR_FLOOR_DB);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{"repeat", 1, 0, 0},
+		{"quick", 0, 0, 1},
+		{"stage", 1, 0, 2},
+		{"snr-reference", 1, 0, 3},
+		{"snr", 1, 0, 4},
+		{0, 0, 0, 0}
+	};
+	struct bench b;
+	unsigned int i;
+	int c, fd, rc, option_index = 0;
+	const char *snr_file = NULL;
+	int snr_write = 0;
+
+	while ((c = getopt_long(argc, argv, "", long_options, &option_index)) != -1) {
+		switch (c) {
+		case 0: /* repeat */
+			if (sscanf(optarg, "%d", &repeat) != 1 || repeat <= 0)
+				usage();
+			break;
+		case 1: /* quick */
+			quick = 1;
+			repeat = 1;
+			break;
+		case 2: /* stage */
+			only_stage = optarg;
+			break;
+		case 3: /* snr-reference */
+			snr_file = optarg;
+			snr_write = 1;
+			break;
+		case 4: /* snr */
+			snr_file = optarg;
+			snr_write = 0;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc)
+		usage();
+	if (only_stage) {
+		for (i = 0; i < ARRAYSIZE(stages); i++)
+			if (strcmp(stages[i].name, only_stage) == 0)
+				break;
+		if (i == ARRAYSIZE(stages)) {
+			fprintf(stderr, "bench_explodomatica: no stage '%s'\n", only_stage);
+			usage();
+		}
+	}
+
+	/* The results go to stdout, the library's chatter doesn't */
+	fflush(stdout);
+	fd = dup(1);
+	out = fd >= 0 ? fdopen(fd, "w") : NULL;
+	if (!out || !freopen("/dev/null", "w", stdout)) {
+		fprintf(stderr, "bench_explodomatica: cannot redirect stdout: %s\n",
+			strerror(errno));
+		return 1;
+	}
+
+	memset(&b, 0, sizeof(b));
+	b.ctx = explodomatica_context_new();
+	b.render = explodomatica_context_new();
+
+	if (snr_file) {
+		rc = snr_write ? snr_reference(&b, snr_file) : snr_compare(&b, snr_file);
+		explodomatica_context_free(b.render);
+		explodomatica_context_free(b.ctx);
+		return (fclose(out) != 0) | rc;
+	}
+
+	fprintf(out, "{\n  \"kernels\": \"%s\",\n  \"sample_bytes\": %d,\n"
+		"  \"cpus\": %ld,\n  \"repeat\": %d,\n  \"results\": [",
+		sample_kernels()->name, (int) sizeof(sample_t),
+		sysconf(_SC_NPROCESSORS_ONLN), repeat);
+	for (i = 0; i < ARRAYSIZE(stages); i++)
+		if (!only_stage || strcmp(stages[i].name, only_stage) == 0)
+			bench_stage(&b, &stages[i]);
+	fprintf(out, "\n  ]\n}\n");
+
+	explodomatica_realtime_free(b.rt);
+	explodomatica_context_free(b.render);
+	explodomatica_context_free(b.ctx);
+	return fclose(out) != 0;
+}
@@ -0,0 +1,196 @@
+/*
+    (C) Copyright 2011, Stephen M. Cameron.
+
+    This file is part of explodomatica.
+
+    explodomatica is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    explodomatica is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with explodomatica; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+/*
+ * Times wwviaudio's mixer, patestCallback(), for mono and stereo output,
+ * a range of slot counts and numbers of sounds playing, with the sounds
+ * panned about, and writes the results to stdout as
+ * JSON.  The mixer is static, so wwviaudio.c is built into this program
+ * rather than linked, and the callback is called directly, as portaudio
+ * would, so no audio device is needed.
+ *
+ * For each case, "callbacks" buffers of FRAMES_PER_BUFFER frames are
+ * mixed, and "ns_per_callback" and "ns_per_voice_frame" (per frame of
+ * each sound playing) are worked out from the best of the repeated runs.
+ */
+#include "wwviaudio.c"
+
+#include <time.h>
+#include <getopt.h>
+
+#define ARRAYSIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define BENCH_CALLBACKS 200
+#define CLIP_SAMPLES ((BENCH_CALLBACKS + 1) * FRAMES_PER_BUFFER)
+
+static const int channel_counts[] = { 1, 2 };
+static const int slot_counts[] = { 32, 256 };
+static const int voice_counts[] = { 0, 1, 4, 16, 64, 255 };
+
+static int repeat = 5;
+static int quick = 0;
+static int ncases = 0;
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double) t.tv_sec + (double) t.tv_nsec * 1e-9;
+}
+
+/* Starts nvoices sounds, all playing clip 1, each panned differently */
+static void start_voices(int nvoices)
+{
+	float buf[FRAMES_PER_BUFFER * WWVIAUDIO_MAX_CHANNELS];
+	int i, ch;
+
+	/* the mixer frees the slots as it takes the commands */
+	wwviaudio_cancel_all_sounds();
+	patestCallback(NULL, buf, 0, NULL, 0, NULL);
+	for (i = 0; i < nvoices; i++) {
+		ch = wwviaudio_add_sound(1);
+		if (ch < 0)
+			fprintf(stderr, "bench_wwviaudio: no slot for voice %d\n", i);
+		else
+			wwviaudio_set_sound_pan(ch, (float) (i % 9) / 4.0f - 1.0f);
+	}
+	patestCallback(NULL, buf, 0, NULL, 0, NULL);
+}
+
+/* Moves every sound a little, as a game might every frame */
+static void move_voices(int nvoices, int callback)
+{
+	int i;
+
+	for (i = 0; i < nvoices; i++)
+		wwviaudio_set_sound_pan(i + 1,
+			(float) ((i + callback) % 9) / 4.0f - 1.0f);
+}
+
+static void bench_case(int16_t *sample, int nchannels, int nslots, int nvoices)
+{
+	float buf[FRAMES_PER_BUFFER * WWVIAUDIO_MAX_CHANNELS];
+	double t, best = 0.0, total = 0.0;
+	int i, j;
+
+	wwviaudio_set_output_channels(nchannels);
+	allocate_mixer(nslots, 2);
+	wwviaudio_use_int16_clip(1, sample, CLIP_SAMPLES);
+	for (i = 0; i < repeat; i++) {
+		start_voices(nvoices);
+		t = now();
+		for (j = 0; j < BENCH_CALLBACKS; j++) {
+			if (j % 4 == 0)
+				move_voices(nvoices, j);
+			patestCallback(NULL, buf, FRAMES_PER_BUFFER, NULL, 0, NULL);
+		}
+		t = now() - t;
+		total += t;
+		if (i == 0 || t < best)
+			best = t;
+	}
+	free_mixer();
+
+	printf("%s\n    { \"channels\": %d, \"slots\": %d, \"voices\": %d, "
+		"\"callbacks\": %d, \"frames_per_callback\": %d, \"best_seconds\": %.9f, "
+		"\"mean_seconds\": %.9f, \"ns_per_callback\": %.1f, "
+		"\"ns_per_voice_frame\": ",
+		ncases++ ? "," : "", nchannels, nslots, nvoices, BENCH_CALLBACKS,
+		FRAMES_PER_BUFFER, best, total / repeat,
+		best * 1e9 / BENCH_CALLBACKS);
+	if (nvoices)
+		printf("%.3f }", best * 1e9 / BENCH_CALLBACKS /
+			FRAMES_PER_BUFFER / nvoices);
+	else
+		printf("null }");
+	fflush(stdout);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: bench_wwviaudio [options] > results.json\n");
+	fprintf(stderr, "options:\n");
+	fprintf(stderr, "  --repeat n      Times each case n times, and reports the best\n");
+	fprintf(stderr, "                  Default is %d\n", repeat);
+	fprintf(stderr, "  --quick         Fewer cases\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{"repeat", 1, 0, 0},
+		{"quick", 0, 0, 1},
+		{0, 0, 0, 0}
+	};
+	int16_t *sample;
+	unsigned int n, s, v;
+	int c, option_index = 0;
+
+	while ((c = getopt_long(argc, argv, "", long_options, &option_index)) != -1) {
+		switch (c) {
+		case 0: /* repeat */
+			if (sscanf(optarg, "%d", &repeat) != 1 || repeat <= 0)
+				usage();
+			break;
+		case 1: /* quick */
+			quick = 1;
+			repeat = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc)
+		usage();
+
+	/* any old noise will do */
+	sample = malloc(sizeof(*sample) * CLIP_SAMPLES);
+	for (s = 0; s < CLIP_SAMPLES; s++)
+		sample[s] = (int16_t) (s * 2654435761U >> 16);
+
+	/* No portaudio: the callback is called from here, so never waited for */
+	sound_working = 1;
+
+	printf("{\n  \"mixer\": \"%s\",\n  \"repeat\": %d,\n  \"results\": [",
+#if defined(__SSE2__)
+		"sse2",
+#else
+		"scalar",
+#endif
+		repeat);
+	for (n = 0; n < ARRAYSIZE(channel_counts); n++) {
+		for (s = 0; s < ARRAYSIZE(slot_counts); s++) {
+			for (v = 0; v < ARRAYSIZE(voice_counts); v++) {
+				if (voice_counts[v] >= slot_counts[s])
+					continue;
+				if (quick && v % 2)
+					continue;
+				bench_case(sample, channel_counts[n], slot_counts[s],
+					voice_counts[v]);
+			}
+		}
+	}
+	printf("\n  ]\n}\n");
+	free(sample);
+	return 0;
+}
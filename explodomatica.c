@@ -29,6 +29,7 @@
 #include <sys/time.h>
 #include <getopt.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include <sndfile.h> /* libsndfile */
 
@@ -36,10 +37,19 @@
 
 static struct explosion_def explodomatica_defaults = EXPLOSION_DEF_DEFAULTS;
 
+static int batch_count = 0;
+static int batch_jobs = 0;
+static char out_pattern[PATH_MAX + 1] = "";
+static char bank_file[PATH_MAX + 1] = "";
+static int bank_format = EXPLODOMATICA_BANK_INT16;
+static int show_stats = 0;
+
 void usage(void)
 {
 	fprintf(stderr, "usage:\n");
 	fprintf(stderr, "explodomatica [options] somefile.wav\n");
+	fprintf(stderr, "explodomatica [options] --batch n --out-pattern boom_%%04d.wav\n");
+	fprintf(stderr, "explodomatica [options] --batch n --bank booms.bank\n");
 	fprintf(stderr, "caution: somefile.wav will be overwritten.\n");
 	fprintf(stderr, "options:\n");
 	fprintf(stderr, "  --duration n    Specifies duration of explosion in secs\n");
@@ -72,12 +82,72 @@ void usage(void)
 	fprintf(stderr, "                  explosion sound. Values greater than 1.0 speed\n");
 	fprintf(stderr, "                  the sound up, values less than 1.0 slow it down\n");
 	fprintf(stderr, "                  Default is %f\n", explodomatica_defaults.final_speed_factor);
+	fprintf(stderr, "  --lowpass-biquad\n");
+	fprintf(stderr, "                  Use steeper second order (Butterworth) low pass\n");
+	fprintf(stderr, "                  filters rather than one pole filters.\n");
+	fprintf(stderr, "  --resampler linear|sinc\n");
+	fprintf(stderr, "                  How to change the speed of sounds.  sinc is\n");
+	fprintf(stderr, "                  slower, but doesn't alias.  Default is linear.\n");
 	fprintf(stderr, "  --noreverb      Suppress the 'reverb' effect\n");
+	fprintf(stderr, "  --reverb-compat\n");
+	fprintf(stderr, "                  Use the slower reverb which is bit for bit\n");
+	fprintf(stderr, "                  identical to the older multi-buffer reverb\n");
+	fprintf(stderr, "  --ir file       Use convolution reverb with the given (44100Hz)\n"
+			"                  wav file as the impulse response, mixed down to\n"
+			"                  mono.  The dry sound is mixed in, so the impulse\n"
+			"                  response should not hold the direct path.\n");
 	fprintf(stderr, "  --input file    Use the given (44100Hz mono) wav file\n"
 			"                  as input instead of generating white noise for input.\n");
+	fprintf(stderr, "  --seed n        Seed for the random number generator.  The same\n");
+	fprintf(stderr, "                  parameters and seed always give the same sound.\n");
+	fprintf(stderr, "  --cache dir     Keep generated explosions in dir, and reuse them\n");
+	fprintf(stderr, "                  when the same explosion is asked for again.\n");
+	fprintf(stderr, "                  Only explosions with a --seed are cached.\n");
+	fprintf(stderr, "  --stream        Write the output as it is generated, rather than\n");
+	fprintf(stderr, "                  holding it all in memory.  Uses several passes, but\n");
+	fprintf(stderr, "                  little memory however long the explosion.\n");
+	fprintf(stderr, "  --stats         Print how long each stage of making the explosion\n");
+	fprintf(stderr, "                  took, and how much memory it used.\n");
+	fprintf(stderr, "  --threads n     Number of threads to make the layers of an\n");
+	fprintf(stderr, "                  explosion with.  Default is the number of online\n");
+	fprintf(stderr, "                  CPUs, or 1 per variant with --batch.\n");
+	fprintf(stderr, "  --batch n       Generate n variants of the explosion in one go.\n");
+	fprintf(stderr, "  --out-pattern p printf style pattern used to name the variants\n");
+	fprintf(stderr, "                  generated by --batch, e.g. boom_%%04d.wav\n");
+	fprintf(stderr, "  --bank file     Put the variants generated by --batch in a single\n");
+	fprintf(stderr, "                  bank file, which games can map into memory.\n");
+	fprintf(stderr, "  --bank-format int16|float\n");
+	fprintf(stderr, "                  How samples are stored in the bank.  Default is int16.\n");
+	fprintf(stderr, "  --jobs n        Number of variants to generate in parallel.\n");
+	fprintf(stderr, "                  Default is the number of online CPUs.\n");
 	exit(1);
 }
 
+/* The pattern gets handed to snprintf, so make sure it has exactly one
+ * conversion and that it is an integer one, e.g. "boom_%04d.wav"
+ */
+static int valid_out_pattern(char *pattern)
+{
+	char *p;
+	int conversions = 0;
+
+	for (p = pattern; *p; p++) {
+		if (*p != '%')
+			continue;
+		p++;
+		if (*p == '%')
+			continue;
+		if (*p == '0' || *p == '-')
+			p++;
+		while (*p >= '0' && *p <= '9')
+			p++;
+		if (*p != 'd')
+			return 0;
+		conversions++;
+	}
+	return conversions == 1;
+}
+
 static void process_options(int argc, char *argv[], struct explosion_def *e)
 {
 	int option_index = 0;
@@ -94,6 +164,20 @@ static void process_options(int argc, char *argv[], struct explosion_def *e)
 		{"pre-lp-count", 1, 0, 6},
 		{"noreverb", 0, 0, 7},
 		{"input", 1, 0, 8},
+		{"reverb-compat", 0, 0, 9},
+		{"ir", 1, 0, 10},
+		{"batch", 1, 0, 11},
+		{"out-pattern", 1, 0, 12},
+		{"jobs", 1, 0, 13},
+		{"seed", 1, 0, 14},
+		{"cache", 1, 0, 15},
+		{"stream", 0, 0, 16},
+		{"threads", 1, 0, 17},
+		{"lowpass-biquad", 0, 0, 18},
+		{"resampler", 1, 0, 19},
+		{"stats", 0, 0, 20},
+		{"bank", 1, 0, 21},
+		{"bank-format", 1, 0, 22},
 		{0, 0, 0, 0}
 	};
 
@@ -162,11 +246,105 @@ static void process_options(int argc, char *argv[], struct explosion_def *e)
 			strncpy(e->input_file, optarg, PATH_MAX);
 			printf("input file: '%s'\n", e->input_file);
 			break;
+		case 9: /* reverb-compat */
+			printf("reverb-compat selected\n");
+			e->reverb_compat = 1;
+			break;
+		case 10: /* impulse response file */
+			strncpy(e->reverb_ir_file, optarg, PATH_MAX);
+			printf("impulse response file: '%s'\n", e->reverb_ir_file);
+			break;
+		case 11: /* batch */
+			n = sscanf(optarg, "%d", &ival);
+			if (n != 1 || ival <= 0)
+				usage();
+			batch_count = ival;
+			printf("batch = %d\n", ival);
+			break;
+		case 12: /* out-pattern */
+			strncpy(out_pattern, optarg, PATH_MAX);
+			if (!valid_out_pattern(out_pattern)) {
+				fprintf(stderr, "explodomatica: --out-pattern must contain "
+					"exactly one %%d style conversion\n");
+				usage();
+			}
+			printf("out pattern: '%s'\n", out_pattern);
+			break;
+		case 13: /* jobs */
+			n = sscanf(optarg, "%d", &ival);
+			if (n != 1 || ival <= 0)
+				usage();
+			batch_jobs = ival;
+			printf("jobs = %d\n", ival);
+			break;
+		case 14: /* seed */
+			n = sscanf(optarg, "%lld", &e->seed);
+			if (n != 1 || e->seed < 0)
+				usage();
+			printf("seed = %lld\n", e->seed);
+			break;
+		case 15: /* cache dir */
+			strncpy(e->cache_dir, optarg, PATH_MAX);
+			printf("cache dir: '%s'\n", e->cache_dir);
+			break;
+		case 16: /* stream */
+			e->stream = 1;
+			break;
+		case 17: /* threads */
+			n = sscanf(optarg, "%d", &ival);
+			if (n != 1 || ival <= 0)
+				usage();
+			e->threads = ival;
+			printf("threads = %d\n", ival);
+			break;
+		case 18: /* lowpass-biquad */
+			e->lowpass_biquad = 1;
+			break;
+		case 19: /* resampler */
+			if (strcmp(optarg, "sinc") == 0)
+				e->resample_sinc = 1;
+			else if (strcmp(optarg, "linear") == 0)
+				e->resample_sinc = 0;
+			else
+				usage();
+			printf("resampler: %s\n", optarg);
+			break;
+		case 20: /* stats */
+			show_stats = 1;
+			break;
+		case 21: /* bank */
+			strncpy(bank_file, optarg, PATH_MAX);
+			printf("bank file: '%s'\n", bank_file);
+			break;
+		case 22: /* bank-format */
+			if (strcmp(optarg, "int16") == 0)
+				bank_format = EXPLODOMATICA_BANK_INT16;
+			else if (strcmp(optarg, "float") == 0)
+				bank_format = EXPLODOMATICA_BANK_FLOAT;
+			else
+				usage();
+			printf("bank format: %s\n", optarg);
+			break;
 			
 		default:
 			usage();
 		}
 	}
+	if (strcmp(bank_file, "") != 0) {
+		if (batch_count <= 0 || strcmp(out_pattern, "") != 0)
+			usage();
+		if (e->stream) {
+			fprintf(stderr, "explodomatica: --stream writes to a file of "
+				"its own, so can't be used with --bank\n");
+			usage();
+		}
+	}
+	if (batch_count > 0) {
+		if ((strcmp(out_pattern, "") == 0 && strcmp(bank_file, "") == 0) ||
+				optind < argc)
+			usage();
+		return;
+	}
 	if (optind < argc) {
 		strcpy(e->save_filename, argv[optind]);
 		printf("save filename is %s\n", e->save_filename);
@@ -174,10 +352,242 @@ static void process_options(int argc, char *argv[], struct explosion_def *e)
 		usage();
 }
 
+/* Batch mode keeps up to batch_jobs explodomatica_thread()s running at
+ * once, starting a new variant whenever one finishes.  Each job slot
+ * has its own render context, so after the first few variants no more
+ * memory is allocated.  With --bank, each variant is written to the
+ * bank as its job finishes, instead of to a file of its own.
+ */
+struct batch {
+	pthread_mutex_t lock;
+	pthread_cond_t job_done;
+	int running;
+	int finished;
+	int failed;		/* variants that didn't render or go in the bank */
+	struct explodomatica_bank_writer *bank;
+	unsigned long long samples;
+	struct explodomatica_stats stats;	/* of all the variants */
+};
+
+#define JOB_IDLE 0
+#define JOB_RUNNING 1
+#define JOB_DONE 2
+
+struct batch_job {
+	struct explosion_def e;
+	struct explodomatica_thread_arg arg;
+	pthread_t thread;
+	struct batch *b;
+	struct explodomatica_context *ctx;
+	struct explodomatica_stats stats;
+	int variant;
+	int state;
+};
+
+static void print_stats(struct explodomatica_stats *st)
+{
+	char buf[1024];
+
+	explodomatica_format_stats(st, buf, sizeof(buf));
+	fputs(buf, stdout);
+}
+
+static void add_stats(struct explodomatica_stats *total,
+		struct explodomatica_stats *st)
+{
+	total->preexplosion_seconds += st->preexplosion_seconds;
+	total->explosion_seconds += st->explosion_seconds;
+	total->speed_change_seconds += st->speed_change_seconds;
+	total->reverb_seconds += st->reverb_seconds;
+	total->save_seconds += st->save_seconds;
+	total->total_seconds += st->total_seconds;
+	total->allocs += st->allocs;
+	total->heap_allocs += st->heap_allocs;
+	total->alloc_bytes += st->alloc_bytes;
+	if (st->peak_bytes > total->peak_bytes)
+		total->peak_bytes = st->peak_bytes;
+	if (st->largest_alloc > total->largest_alloc)
+		total->largest_alloc = st->largest_alloc;
+	total->samples += st->samples;
+}
+
+static void batch_job_done(struct sound *s, void *arg)
+{
+	struct batch_job *job = arg;
+	struct batch *b = job->b;
+
+	pthread_mutex_lock(&b->lock);
+	if (s)
+		b->samples += s->nsamples;
+	else
+		b->failed++;
+	if (b->bank && explodomatica_bank_add(b->bank, job->variant, &job->e, s) != 0)
+		b->failed++;
+	if (job->e.stats)
+		add_stats(&b->stats, job->e.stats);
+	b->running--;
+	b->finished++;
+	job->state = JOB_DONE;
+	pthread_cond_signal(&b->job_done);
+	pthread_mutex_unlock(&b->lock);
+	/* s belongs to job->ctx */
+}
+
+static void print_cache_stats(struct explosion_def *e)
+{
+	unsigned long hits, misses;
+
+	if (strcmp(e->cache_dir, "") == 0)
+		return;
+	explodomatica_cache_stats(&hits, &misses);
+	printf("Render cache: %lu hits, %lu misses\n", hits, misses);
+}
+
+static void print_context_stats(struct batch_job *job, int njobs)
+{
+	struct explodomatica_context_stats stats;
+	unsigned long allocs = 0, heap_allocs = 0;
+	unsigned long long peak = 0;
+	int i;
+
+	for (i = 0; i < njobs; i++) {
+		explodomatica_context_stats(job[i].ctx, &stats);
+		allocs += stats.allocs;
+		heap_allocs += stats.heap_allocs;
+		if (stats.peak_bytes > peak)
+			peak = stats.peak_bytes;
+	}
+	printf("Render memory: %lu allocations, %lu from the heap, "
+		"%llu bytes peak per job\n", allocs, heap_allocs, peak);
+}
+
+static double elapsed_secs(struct timeval *start, struct timeval *end)
+{
+	return (double) (end->tv_sec - start->tv_sec) +
+		(double) (end->tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/* Returns the number of variants that failed */
+static int run_batch(struct explosion_def *e)
+{
+	struct batch b;
+	struct batch_job *job;
+	struct timeval start, end;
+	int i, next;
+	double secs;
+	long long base_seed;
+
+	if (batch_jobs <= 0)
+		batch_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (batch_jobs <= 0)
+		batch_jobs = 1;
+	if (batch_jobs > batch_count)
+		batch_jobs = batch_count;
+	if (e->nlayers <= 0) {
+		fprintf(stderr, "explodomatica: nlayers must be greater than zero\n");
+		exit(1);
+	}
+
+	/* the variants already keep every CPU busy */
+	if (e->threads <= 0)
+		e->threads = 1;
+
+	/* read any input files once, all variants share the data */
+	if (explodomatica_load_input(e) != 0)
+		exit(1);
+
+	job = malloc(sizeof(*job) * batch_jobs);
+	memset(job, 0, sizeof(*job) * batch_jobs);
+	for (i = 0; i < batch_jobs; i++)
+		job[i].ctx = explodomatica_context_new();
+	memset(&b, 0, sizeof(b));
+	pthread_mutex_init(&b.lock, NULL);
+	pthread_cond_init(&b.job_done, NULL);
+	if (strcmp(bank_file, "") != 0) {
+		b.bank = explodomatica_bank_create(bank_file, batch_count, bank_format);
+		if (!b.bank)
+			exit(1);
+	}
+
+	/* variant n gets seed base_seed + n, so any one of them can be regenerated */
+	if (e->seed >= 0)
+		base_seed = e->seed;
+	else
+		base_seed = (unsigned long long) rand();
+	printf("Generating %d variants, %d at a time, seeds %lld through %lld\n",
+		batch_count, batch_jobs, base_seed, base_seed + batch_count - 1);
+	gettimeofday(&start, NULL);
+
+	next = 0;
+	pthread_mutex_lock(&b.lock);
+	while (b.finished < batch_count) {
+		for (i = 0; i < batch_jobs; i++) {
+			if (job[i].state == JOB_DONE) {
+				pthread_join(job[i].thread, NULL);
+				job[i].state = JOB_IDLE;
+			}
+			if (job[i].state != JOB_IDLE || next >= batch_count)
+				continue;
+			job[i].e = *e;
+			job[i].e.seed = base_seed + next;
+			if (!b.bank)
+				snprintf(job[i].e.save_filename,
+					sizeof(job[i].e.save_filename), out_pattern, next);
+			job[i].variant = next;
+			job[i].e.context = job[i].ctx;
+			job[i].e.stats = show_stats ? &job[i].stats : NULL;
+			job[i].e.quiet = 1;	/* jobs would print over each other */
+			job[i].b = &b;
+			job[i].arg.e = &job[i].e;
+			job[i].arg.f = batch_job_done;
+			job[i].arg.arg = &job[i];
+			job[i].state = JOB_RUNNING;
+			b.running++;
+			next++;
+			explodomatica_thread(&job[i].thread, &job[i].arg);
+		}
+		if (b.finished < batch_count)
+			pthread_cond_wait(&b.job_done, &b.lock);
+	}
+	pthread_mutex_unlock(&b.lock);
+	for (i = 0; i < batch_jobs; i++)
+		if (job[i].state == JOB_DONE)
+			pthread_join(job[i].thread, NULL);
+
+	if (b.bank && explodomatica_bank_finish(b.bank) != 0)
+		exit(1);
+
+	gettimeofday(&end, NULL);
+	secs = elapsed_secs(&start, &end);
+	if (secs <= 0.0)
+		secs = 1e-6;
+	printf("Generated %d variants (%llu samples) in %.3f secs\n",
+		batch_count, b.samples, secs);
+	printf("  %.2f variants/sec, %.0f samples/sec\n",
+		(double) batch_count / secs, (double) b.samples / secs);
+	if (b.failed)
+		fprintf(stderr, "explodomatica: %d of %d variants failed\n",
+			b.failed, batch_count);
+	print_cache_stats(e);
+	print_context_stats(job, batch_jobs);
+	if (show_stats) {
+		printf("Summed over all variants:\n");
+		print_stats(&b.stats);
+	}
+
+	pthread_cond_destroy(&b.job_done);
+	pthread_mutex_destroy(&b.lock);
+	for (i = 0; i < batch_jobs; i++)
+		explodomatica_context_free(job[i].ctx);
+	free(job);
+	return b.failed;
+}
+
 int main(int argc, char *argv[])
 {
 	struct timeval tv;
 	struct explosion_def e;
+	struct explodomatica_stats stats;
 	struct sound *s;
 
 	e = explodomatica_defaults;
@@ -189,8 +599,18 @@ int main(int argc, char *argv[])
 		usage();
 
 	process_options(argc, argv, &e);
+	if (batch_count > 0) {
+		return run_batch(&e) != 0;
+	}
+	if (show_stats)
+		e.stats = &stats;
 	s = explodomatica(&e);
+	if (!s)
+		return 1;
 	free_sound(s);
+	print_cache_stats(&e);
+	if (show_stats)
+		print_stats(&stats);
 
 	return 0;
 }
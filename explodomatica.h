@@ -27,15 +27,51 @@
 #define GLOBAL extern
 #endif
 
+/* Building with -DEXPLODOMATICA_FLOAT32 (make FLOAT32=1) runs the
+ * whole pipeline on single precision samples.
+ */
+#ifdef EXPLODOMATICA_FLOAT32
+typedef float sample_t;
+#else
+typedef double sample_t;
+#endif
+
 struct sound {
-        double *data;
+        sample_t *data;
         int nsamples;
 };
 
+struct explodomatica_context;
+
+/* Where a render's time and memory went, filled in by explodomatica()
+ * if e->stats is set.  Times are wall clock seconds.  The pre-explosions
+ * and the main explosion are made together, so their times split the
+ * layer making where the last pre-explosion is mixed in.  A streamed
+ * render does every stage a block at a time, so only the totals are
+ * filled in for one.
+ */
+struct explodomatica_stats {
+	double preexplosion_seconds;
+	double explosion_seconds;
+	double speed_change_seconds;
+	double reverb_seconds;
+	double save_seconds;		/* save_filename and the cache */
+	double total_seconds;
+	unsigned long allocs;		/* allocations from the render context */
+	unsigned long heap_allocs;	/* of those and the context's own, malloc()s */
+	unsigned long long alloc_bytes;	/* bytes of those allocations */
+	unsigned long long peak_bytes;	/* most bytes in use at once */
+	unsigned long long largest_alloc;	/* biggest buffer */
+	unsigned long long samples;	/* samples made, counting every stage */
+	int cached;			/* came from the render cache */
+	int streamed;
+	int cancelled;
+};
+
 struct explosion_def {
 	char save_filename[PATH_MAX + 1];
 	char input_file[PATH_MAX + 1];
-	double *input_data;
+	sample_t *input_data;
 	unsigned long long input_samples;
 	double duration;
 	int nlayers;
@@ -47,6 +83,24 @@ struct explosion_def {
 	int reverb_early_refls;
 	int reverb_late_refls;
 	int reverb; 
+	int reverb_compat;
+	char reverb_ir_file[PATH_MAX + 1];
+	sample_t *ir_data;
+	unsigned long long ir_samples;
+	unsigned long long rng[4];	/* random number generator state */
+	volatile float *progress;	/* if non-NULL, updated from 0.0 to 1.0 */
+	volatile int cancel;		/* see explodomatica_cancel() */
+	long long seed;			/* -1 means pick one at random */
+	char cache_dir[PATH_MAX + 1];	/* "" means don't cache */
+	int stream;			/* render straight to save_filename */
+	struct explodomatica_context *context;	/* NULL: the library's own */
+	int threads;			/* threads making layers, 0: one per CPU */
+	int lowpass_biquad;		/* Butterworth rather than one pole low pass */
+	int resample_sinc;		/* windowed sinc rather than linear resampling */
+	struct explodomatica_stats *stats;	/* if non-NULL, filled in */
+	void (*progress_fn)(void *arg, float progress);	/* if non-NULL, called */
+	void *progress_arg;		/* with this, as *progress is updated */
+	int quiet;			/* don't print what the render is doing */
 };
 
 /* Initializer for struct explosion_def */
@@ -65,10 +119,181 @@ struct explosion_def {
 	10,	/* final reverb early reflections */ \
 	50,	/* final reverb late reflections */ \
 	1,	/* reverb wanted? */ \
+	0,	/* reverb identical to old multi-buffer reverb? */ \
+	{ 0 },	/* impulse response for convolution reverb */ \
+	NULL, \
+	0LL, \
+	{ 0 },	/* rng state, seeded on first use if all zero */ \
+	NULL,	/* progress */ \
+	0,	/* cancel */ \
+	-1LL,	/* seed */ \
+	{ 0 },	/* cache dir */ \
+	0,	/* stream */ \
+	NULL,	/* context */ \
+	0,	/* threads */ \
+	0,	/* lowpass_biquad */ \
+	0,	/* resample_sinc */ \
+	NULL,	/* stats */ \
+	NULL,	/* progress_fn */ \
+	NULL,	/* progress_arg */ \
+	0,	/* quiet */ \
 };
 
+/* Makes an explosion, and saves it in e->save_filename if that is set.
+ * With e->stream set, the explosion is instead written to save_filename
+ * a block at a time, never being held in memory as a whole, and the
+ * sound returned has no data, just the number of samples written.
+ * Streamed explosions are not cached.
+ */
 GLOBAL struct sound *explodomatica(struct explosion_def *e);
 
+/* Asks the explodomatica() rendering *e, on another thread, to stop.
+ * Every stage checks for this at least every few thousand samples, so
+ * the render gives up within milliseconds, releasing what it was using,
+ * and explodomatica() returns NULL.  Progress is reported, through
+ * e->progress and e->progress_fn, at the same points, on the rendering
+ * thread.  Clear e->cancel before rendering with *e again.
+ */
+GLOBAL void explodomatica_cancel(struct explosion_def *e);
+
+/* Deprecated, use e->progress or e->progress_fn instead, which are kept
+ * per explosion.  Every render's progress also goes to *progress, as it
+ * did before explosion_def had progress of its own, so with more than
+ * one render at a time their progress is mixed together.
+ */
+#ifdef __GNUC__
+__attribute__ ((deprecated))
+#endif
+GLOBAL void explodomatica_progress_variable(volatile float *progress);
+
+/* Realtime engine, for making explosions as they play, from an audio
+ * callback such as PortAudio's.  explodomatica_realtime_new() does the
+ * slow part, once, for explosions like *e: it may take as long as
+ * rendering one, and is no business of the audio thread's (it returns
+ * NULL if e's input files can't be used, or the engine can't be
+ * allocated.)  After that, explodomatica_realtime_trigger() starts a
+ * new explosion, from seed, at once, and explodomatica_realtime_render()
+ * fills out with the next nframes samples of it, returning how many of
+ * them are explosion (the rest are silence; 0 once it is over.)  Neither allocates, locks or
+ * does more than a bounded amount of work per sample: 256 samples are
+ * made at a time, the same work each time, even with a convolution
+ * reverb (whose cost per sample grows with the length of the impulse
+ * response.)  Both must be
+ * called from the same thread, or be otherwise kept from running at
+ * once.  An engine plays one explosion at a time; a triggered explosion
+ * replaces whatever was playing.
+ *
+ * The explosions are those e->stream would write, except that their
+ * levels are set by e's own seed (or a random one), so they may peak a
+ * little over or under full scale.
+ */
+struct explodomatica_realtime;
+
+GLOBAL struct explodomatica_realtime *explodomatica_realtime_new(struct explosion_def *e);
+GLOBAL void explodomatica_realtime_free(struct explodomatica_realtime *rt);
+GLOBAL void explodomatica_realtime_trigger(struct explodomatica_realtime *rt,
+		unsigned long long seed);
+GLOBAL int explodomatica_realtime_render(struct explodomatica_realtime *rt,
+		float *out, int nframes);
+
+/* Variant banks.  A bank is a single file holding many explosions, as
+ * 16 bit or float samples, with the seed and parameters each was made
+ * with, laid out so that explodomatica_bank_open() can map the file into
+ * memory and hand out pointers straight into it: opening a bank reads
+ * only its index, however many explosions are in it.  The file is in
+ * the byte order of the machine which wrote it.
+ *
+ * To make one, explodomatica_bank_create() it for nvariants explosions,
+ * explodomatica_bank_add() each as it is made, in any order, then
+ * explodomatica_bank_finish() it, which returns 0 if the bank was
+ * written.  Until then the bank is kept in a temporary file, so nobody
+ * ever sees a partly written one.  Variants never added are empty.
+ */
+#define EXPLODOMATICA_BANK_INT16 1
+#define EXPLODOMATICA_BANK_FLOAT 2
+
+struct explodomatica_bank;
+struct explodomatica_bank_writer;
+
+GLOBAL struct explodomatica_bank_writer *explodomatica_bank_create(const char *filename,
+		int nvariants, int format);
+GLOBAL int explodomatica_bank_add(struct explodomatica_bank_writer *w, int variant,
+		struct explosion_def *e, struct sound *s);
+GLOBAL int explodomatica_bank_finish(struct explodomatica_bank_writer *w);
+
+/* explodomatica_bank_samples() returns variant's samples, int16_t or
+ * float as explodomatica_bank_format() says, and their number in
+ * *nsamples, or NULL if there is no such variant.  They are good until
+ * explodomatica_bank_close().  explodomatica_bank_params() sets the
+ * seed and parameters of *e, and its input and impulse response file
+ * names, to those variant was made with, so that explodomatica(e) makes
+ * it again, and returns 0, or -1 if there is no such variant.  Where a
+ * file name changes, e->input_data or e->ir_data is set to NULL, for
+ * the file to be read (free it first if it is yours.)  Files are named
+ * as they were given to the bank's writer, and a variant made from
+ * input_data or ir_data without a file name can't be made again.
+ */
+GLOBAL struct explodomatica_bank *explodomatica_bank_open(const char *filename);
+GLOBAL void explodomatica_bank_close(struct explodomatica_bank *b);
+GLOBAL int explodomatica_bank_count(struct explodomatica_bank *b);
+GLOBAL int explodomatica_bank_format(struct explodomatica_bank *b);
+GLOBAL const void *explodomatica_bank_samples(struct explodomatica_bank *b,
+		int variant, int *nsamples);
+GLOBAL int explodomatica_bank_params(struct explodomatica_bank *b, int variant,
+		struct explosion_def *e);
+
+/* A render context holds the memory explodomatica() works in, so that
+ * making one explosion after another in the same context allocates
+ * nothing once the first is done.  With e->context set, the sound
+ * explodomatica() returns lives in the context, and is only good until
+ * the context's next render; don't free_sound() it.  A context may only
+ * be used by one explodomatica() at a time.  Without e->context, the
+ * library keeps a context of its own between calls, and returns a copy
+ * of the sound, which the caller free_sound()s.  Should the heap run out
+ * while rendering, the library says so and abort()s.
+ */
+struct explodomatica_context_stats {
+	unsigned long renders;		/* explodomatica() calls */
+	unsigned long allocs;		/* allocations from the context */
+	unsigned long heap_allocs;	/* of those and the context's own, malloc()s */
+	unsigned long long peak_bytes;	/* most memory any render needed */
+	unsigned long long capacity;	/* memory the context holds now */
+};
+
+GLOBAL struct explodomatica_context *explodomatica_context_new(void);
+GLOBAL void explodomatica_context_free(struct explodomatica_context *ctx);
+GLOBAL void explodomatica_context_stats(struct explodomatica_context *ctx,
+		struct explodomatica_context_stats *stats);
+
+/* Reads e->input_file and e->reverb_ir_file, if not already read.
+ * explodomatica() does this itself, but calling it up front lets
+ * copies of *e share the data rather than each reading the files.
+ * The impulse response must be 44100 Hz; more than one channel is mixed
+ * down to mono.  Returns 0, or -1 (having said why) if a file can't be
+ * read or used, in which case explodomatica() returns NULL.
+ */
+GLOBAL int explodomatica_load_input(struct explosion_def *e);
+
+/* Seeds the random number generator of *e.  Two explosions with the same
+ * parameters and seed sound the same.  An explosion which has not been
+ * seeded is seeded from rand() by explodomatica().
+ */
+GLOBAL void explodomatica_seed(struct explosion_def *e, unsigned long long seed);
+
+/* Number of render cache lookups which found, or did not find,
+ * a previously generated explosion (see explosion_def.cache_dir).
+ */
+GLOBAL void explodomatica_cache_stats(unsigned long *hits, unsigned long *misses);
+
+/* Describes *st in buf, a line per stage, as --stats prints it.  Returns
+ * what snprintf() does.
+ */
+GLOBAL int explodomatica_format_stats(struct explodomatica_stats *st,
+		char *buf, int len);
+
+/* Called by the thread explodomatica_thread() starts when it is done,
+ * with NULL if the render was cancelled or failed.
+ */
 typedef void (*explodomatica_callback)(struct sound *s, void *arg);
 
 struct explodomatica_thread_arg {
@@ -81,6 +306,5 @@ GLOBAL void explodomatica_thread(pthread_t *t, struct explodomatica_thread_arg *
 
 GLOBAL void free_sound(struct sound *s);
 GLOBAL int explodomatica_save_file(char *filename, struct sound *s, int channels);
-GLOBAL void explodomatica_progress_variable(volatile float *progress);
 
 #endif
@@ -40,7 +40,7 @@ struct slider_spec {
 	double r1, r2, inc, initial_value;
 	char *tooltiptext;
 } sliderspeclist[] = {
-	{ "Layers:", 1.0, 6.0, 1.0, 4.0,
+	{ "Layers:", 1.0, 100.0, 1.0, 4.0,
 			"Specifies number of sound layers to use to build up each explosion" },
 	{ "Duration (secs):", 0.2, 60.0, 0.05, 15.0,
 			"Specifies duration of explosion in seconds" },
@@ -120,6 +120,7 @@ struct gui {
 	GtkWidget *progress_bar;
 	volatile float progress;
 	struct explosion_def e;
+	struct explodomatica_stats stats;
 	struct explodomatica_thread_arg arg;
 	int ptimer;
 	pthread_t t;
@@ -147,22 +148,24 @@ static void playclicked(__attribute__((unused)) GtkWidget *widget,
 		return;
 	}
 	wwviaudio_cancel_all_sounds();
+#ifdef EXPLODOMATICA_FLOAT32
+	wwviaudio_use_float_clip(1, generated_sound->data, generated_sound->nsamples);
+#else
 	wwviaudio_use_double_clip(1, generated_sound->data, generated_sound->nsamples);
+#endif
 	wwviaudio_add_sound(1);
 }
 
+/* The render notices within a few milliseconds, and finishes up as
+ * usual, but with no sound; update_progress_bar() takes it from there.
+ */
 static void cancelclicked(__attribute__((unused)) GtkWidget *widget,
 		__attribute__((unused)) gpointer data)
 {
 	struct gui *ui = data;
 	if (ui->thread_done)
 		return;
-	pthread_cancel(ui->t);
-	ui->progress = 0.0;
-	generated_sound = 0;
-	gtk_widget_set_sensitive(ui->button[GENERATEBUTTON], 1);
-	gtk_widget_set_sensitive(ui->button[SAVEBUTTON], 0);
-	gtk_widget_set_sensitive(ui->button[PLAYBUTTON], 0);
+	explodomatica_cancel(&ui->e);
 	gtk_widget_set_sensitive(ui->button[CANCELBUTTON], 0);
 }
 
@@ -192,6 +195,7 @@ static void inputclicked(__attribute__((unused)) GtkWidget *widget, gpointer dat
 #define REVERB_EARLY_REFLS 7
 #define REVERB_LATE_REFLS 8
 
+/* s is NULL if the render was cancelled */
 static void data_ready(struct sound *s, void *x)
 {
 	struct gui *ui = x;
@@ -234,9 +238,13 @@ static void generateclicked(__attribute__((unused)) GtkWidget *widget, gpointer
 	ui->e.reverb_early_refls = (int) gtk_range_get_value(GTK_RANGE(ui->sliderlist[REVERB_EARLY_REFLS].slider));
 	ui->e.reverb_late_refls = (int) gtk_range_get_value(GTK_RANGE(ui->sliderlist[REVERB_LATE_REFLS].slider));
 	ui->e.reverb = gtk_toggle_button_get_active((GtkToggleButton *) ui->reverbcheck);
+	ui->e.progress = &ui->progress;
+	ui->e.stats = &ui->stats;
+	gtk_progress_bar_set_text(GTK_PROGRESS_BAR(ui->progress_bar), "");
 
 	if (generated_sound)
 		free_sound(generated_sound);
+	generated_sound = NULL;
 
 	ui->arg.e = &ui->e;
 	ui->arg.f = data_ready; 
@@ -293,6 +301,22 @@ static void input_file_selected(__attribute__((unused)) GtkWidget *w, struct gui
 	return;
 }
 
+/* Shows how long the explosion took on the progress bar, and the rest
+ * of the stats in its tooltip.
+ */
+static void show_stats(struct gui *ui)
+{
+	char buf[1024];
+
+	explodomatica_format_stats(&ui->stats, buf, sizeof(buf));
+	gtk_widget_set_tooltip_text(ui->progress_bar, buf);
+	if (ui->stats.cancelled)
+		snprintf(buf, sizeof(buf), "Cancelled");
+	else
+		snprintf(buf, sizeof(buf), "Made in %.2f secs", ui->stats.total_seconds);
+	gtk_progress_bar_set_text(GTK_PROGRESS_BAR(ui->progress_bar), buf);
+}
+
 static gint update_progress_bar(gpointer data)
 {
 	struct gui *ui = data;
@@ -306,11 +330,12 @@ static gint update_progress_bar(gpointer data)
 	if (ui->thread_done) {
 		/* enable save and play buttons after sound is generated */
 		gtk_widget_set_sensitive(ui->button[GENERATEBUTTON], 1);
-		gtk_widget_set_sensitive(ui->button[SAVEBUTTON], 1);
-		gtk_widget_set_sensitive(ui->button[PLAYBUTTON], 1);
+		gtk_widget_set_sensitive(ui->button[SAVEBUTTON], generated_sound != NULL);
+		gtk_widget_set_sensitive(ui->button[PLAYBUTTON], generated_sound != NULL);
 		gtk_widget_set_sensitive(ui->button[CANCELBUTTON], 0);
 		pthread_join(ui->t, NULL);
 		ui->thread_done = 0;
+		show_stats(ui);
 	}
 	return TRUE;
 }
@@ -416,7 +441,6 @@ static void init_ui(int *argc, char **argv[], struct gui *ui)
 	gtk_widget_show(ui->drawing_area);
 	gtk_widget_show(ui->window);
 	ui->ptimer = gtk_timeout_add(200, update_progress_bar, ui);
-	explodomatica_progress_variable(&ui->progress);
 }
 
 int main(int argc, char *argv[])
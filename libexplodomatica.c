@@ -22,34 +22,112 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <malloc.h>
 #include <math.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <getopt.h>
 #include <limits.h>
 #include <pthread.h>
 #include <assert.h>
+#include <time.h>
 
 #include <sndfile.h> /* libsndfile */
 
 #define DEFINE_EXPLODOMATICA_GLOBALS 1
 #include "explodomatica.h"
+#include "sample_kernels.h"
 	
 #define SAMPLERATE 44100
+
+#ifdef EXPLODOMATICA_FLOAT32
+#define sf_read_samples sf_read_float
+#define sf_write_samples sf_write_float
+#define SF_FORMAT_SAMPLES SF_FORMAT_FLOAT
+#else
+#define sf_read_samples sf_read_double
+#define sf_write_samples sf_write_double
+#define SF_FORMAT_SAMPLES SF_FORMAT_DOUBLE
+#endif
 #define ARRAYSIZE(x) (sizeof(x) / sizeof((x)[0]))
 
-static volatile float *explodomatica_progress = NULL;
+/* Each explosion carries its own random number generator state
+ * (xoshiro256**, seeded via splitmix64) so that several explosions
+ * can be generated at once on different threads without contending
+ * for, or perturbing, each other's random numbers.  Each layer of
+ * noise is made by the noise kernel from a key of its own, drawn from
+ * the explosion's generator, so the noise does not depend on the order
+ * in which layers are made.
+ */
+static unsigned long long rotl(unsigned long long x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+static unsigned long long rng_next(unsigned long long *s)
+{
+	unsigned long long result, t;
+
+	result = rotl(s[1] * 5, 7) * 9;
+	t = s[1] << 17;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
+	return result;
+}
+
+static void rng_seed(unsigned long long *s, unsigned long long seed)
+{
+	int i;
+	unsigned long long z;
+
+	for (i = 0; i < 4; i++) {
+		seed += 0x9e3779b97f4a7c15ULL;
+		z = seed;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		s[i] = z ^ (z >> 31);
+	}
+}
+
+static double rng_drand(unsigned long long *s)
+{
+	return (double) (rng_next(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static unsigned long long next_random(struct explosion_def *e)
+{
+	return rng_next(e->rng);
+}
+
+void explodomatica_seed(struct explosion_def *e, unsigned long long seed)
+{
+	rng_seed(e->rng, seed);
+}
+
+/* returns a random number between 0 and 0x0ffff inclusive */
+static int rand16(struct explosion_def *e)
+{
+	return (int) (next_random(e) >> 48);
+}
 
-static double drand(void)
+static double drand(struct explosion_def *e)
 {
-	return (double) rand() / (double) RAND_MAX;
+	return rng_drand(e->rng);
 }
 
-static int irand(int n)
+static int irand(struct explosion_def *e, int n)
 {
-	return (n * (rand() & 0x0ffff)) / 0x0ffff;
+	return (int) (((long long) n * rand16(e)) / 0x0ffff);
 }
 
 void free_sound(struct sound *s)
@@ -62,23 +140,260 @@ void free_sound(struct sound *s)
 	s->nsamples = 0;
 }
 
-static struct sound *alloc_sound(int nsamples)
+/* Render context.  Everything explodomatica() needs while rendering
+ * comes out of the context's arena, a single block of memory handed out
+ * in order and taken back all at once when the next render starts (or,
+ * part way through a render, back to an earlier mark.)  The arena is
+ * sized up front for the explosion about to be made and never shrinks,
+ * so once a context has made an explosion, making more like it does
+ * no heap allocation at all.  Should the arena run out anyway, memory
+ * is borrowed from malloc until the next render, which gets an arena
+ * big enough to need no such help.  If even malloc has nothing left, no
+ * stage could go on, so the render is abandoned with out_of_memory().
+ */
+#define ARENA_ALIGN 64
+
+static void out_of_memory(size_t bytes)
+{
+	fprintf(stderr, "explodomatica: Cannot allocate %lu bytes\n",
+		(unsigned long) bytes);
+	abort();
+}
+
+struct arena_spill {
+	struct arena_spill *next;
+};
+
+struct layer_pool;
+static void layer_pool_free(struct layer_pool *p);
+
+struct explodomatica_context {
+	char *base;
+	size_t size;
+	size_t used;		/* bytes of the arena handed out */
+	size_t in_use;		/* bytes handed out, including spills */
+	size_t peak;		/* most bytes in use at once, this render */
+	struct arena_spill *spills;
+	struct explodomatica_context_stats stats;
+	struct layer_pool *pool;	/* threads making layers, if any */
+	int no_pool;		/* make layers on the rendering thread alone */
+
+	/* this render's allocations, for struct explodomatica_stats */
+	unsigned long render_allocs, render_heap_allocs;
+	unsigned long long render_bytes;
+	size_t render_peak, render_largest;
+
+	/* the part of the progress bar the current stage fills */
+	float progress_lo, progress_hi;
+};
+
+/* Renders are cancelled from other threads, by setting e->cancel, which
+ * every stage looks at every CANCEL_BLOCK samples or so.
+ */
+#define CANCEL_BLOCK 16384
+
+void explodomatica_cancel(struct explosion_def *e)
+{
+	__atomic_store_n(&e->cancel, 1, __ATOMIC_RELAXED);
+}
+
+static int cancelled(struct explosion_def *e)
+{
+	return e && __atomic_load_n(&e->cancel, __ATOMIC_RELAXED);
+}
+
+/* Set by the deprecated explodomatica_progress_variable() */
+static volatile float *explodomatica_progress = NULL;
+
+void explodomatica_progress_variable(volatile float *progress)
+{
+	explodomatica_progress = progress;
+}
+
+static void report_progress(struct explosion_def *e, float progress)
+{
+	if (explodomatica_progress)
+		*explodomatica_progress = progress;
+	if (e->progress)
+		*e->progress = progress;
+	if (e->progress_fn)
+		e->progress_fn(e->progress_arg, progress);
+}
+
+/* The next stage takes the progress from lo to hi */
+static void begin_stage(struct explodomatica_context *ctx,
+		struct explosion_def *e, float lo, float hi)
+{
+	ctx->progress_lo = lo;
+	ctx->progress_hi = hi;
+	report_progress(e, lo);
+}
+
+/* Reports that fraction of the current stage is done, and returns non-zero
+ * if the render has been cancelled.  Progress is only reported on the
+ * rendering thread; elsewhere, ctx is NULL and this just checks for
+ * cancellation.
+ */
+static int stage_progress(struct explodomatica_context *ctx,
+		struct explosion_def *e, float fraction)
+{
+	if (ctx)
+		report_progress(e, ctx->progress_lo +
+			fraction * (ctx->progress_hi - ctx->progress_lo));
+	return cancelled(e);
+}
+
+struct arena_mark {
+	size_t used, in_use;
+};
+
+struct explodomatica_context *explodomatica_context_new(void)
+{
+	struct explodomatica_context *ctx;
+
+	ctx = malloc(sizeof(*ctx));
+	if (!ctx)
+		out_of_memory(sizeof(*ctx));
+	memset(ctx, 0, sizeof(*ctx));
+	return ctx;
+}
+
+static void arena_free_spills(struct explodomatica_context *ctx)
+{
+	struct arena_spill *s, *next;
+
+	for (s = ctx->spills; s; s = next) {
+		next = s->next;
+		free(s);
+	}
+	ctx->spills = NULL;
+}
+
+void explodomatica_context_free(struct explodomatica_context *ctx)
+{
+	if (!ctx)
+		return;
+	arena_free_spills(ctx);
+	layer_pool_free(ctx->pool);
+	free(ctx->base);
+	free(ctx);
+}
+
+void explodomatica_context_stats(struct explodomatica_context *ctx,
+		struct explodomatica_context_stats *stats)
+{
+	*stats = ctx->stats;
+	stats->capacity = ctx->size;
+}
+
+/* Starts a new render, needing about size bytes */
+static void arena_reset(struct explodomatica_context *ctx, size_t size)
+{
+	void *p;
+
+	ctx->render_allocs = 0;
+	ctx->render_heap_allocs = 0;
+	ctx->render_bytes = 0;
+	ctx->render_peak = 0;
+	ctx->render_largest = 0;
+	arena_free_spills(ctx);
+	if (size < ctx->peak)
+		size = ctx->peak;
+	if (size > ctx->size) {
+		free(ctx->base);
+		ctx->base = NULL;
+		ctx->size = 0;
+		if (posix_memalign(&p, ARENA_ALIGN, size) == 0) {
+			ctx->base = p;
+			ctx->size = size;
+		}
+		ctx->stats.heap_allocs++;
+		ctx->render_heap_allocs++;
+	}
+	ctx->used = 0;
+	ctx->in_use = 0;
+	ctx->stats.renders++;
+}
+
+static void *arena_alloc(struct explodomatica_context *ctx, size_t bytes)
+{
+	struct arena_spill *s;
+	void *p;
+
+	bytes = (bytes + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+	ctx->stats.allocs++;
+	ctx->render_allocs++;
+	ctx->render_bytes += bytes;
+	if (bytes > ctx->render_largest)
+		ctx->render_largest = bytes;
+	ctx->in_use += bytes;
+	if (ctx->in_use > ctx->peak)
+		ctx->peak = ctx->in_use;
+	if (ctx->in_use > ctx->render_peak)
+		ctx->render_peak = ctx->in_use;
+	if (ctx->peak > ctx->stats.peak_bytes)
+		ctx->stats.peak_bytes = ctx->peak;
+	if (ctx->used + bytes <= ctx->size) {
+		p = ctx->base + ctx->used;
+		ctx->used += bytes;
+		return p;
+	}
+	/* the link goes in the first ARENA_ALIGN bytes, keeping the rest aligned */
+	ctx->stats.heap_allocs++;
+	ctx->render_heap_allocs++;
+	if (posix_memalign(&p, ARENA_ALIGN, ARENA_ALIGN + bytes) != 0)
+		out_of_memory(ARENA_ALIGN + bytes);
+	s = p;
+	s->next = ctx->spills;
+	ctx->spills = s;
+	return (char *) s + ARENA_ALIGN;
+}
+
+static struct arena_mark arena_mark(struct explodomatica_context *ctx)
+{
+	struct arena_mark m;
+
+	m.used = ctx->used;
+	m.in_use = ctx->in_use;
+	return m;
+}
+
+/* Takes back everything allocated since the mark */
+static void arena_release(struct explodomatica_context *ctx, struct arena_mark m)
+{
+	ctx->used = m.used;
+	ctx->in_use = m.in_use;
+}
+
+static size_t arena_bytes(size_t bytes)
+{
+	return (bytes + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+}
+
+static struct sound *alloc_sound(struct explodomatica_context *ctx, int nsamples)
 {
 	struct sound *s;
 
-	s = malloc(sizeof(*s));
-	s->data = malloc(sizeof(*s->data) * nsamples);
+	s = arena_alloc(ctx, sizeof(*s));
+	s->data = arena_alloc(ctx, sizeof(*s->data) * nsamples);
 	memset(s->data, 0, sizeof(*s->data) * nsamples);
 	s->nsamples = 0;
 	return s;
 }
 
+/* Bytes alloc_sound() uses */
+static size_t sound_bytes(int nsamples)
+{
+	return arena_bytes(sizeof(struct sound)) +
+		arena_bytes(sizeof(sample_t) * nsamples);
+}
+
 int seconds_to_frames(double seconds)
 {
 	return seconds * SAMPLERATE;
 }
 
-int explodomatica_save_file(char *filename, struct sound *s, int channels)
+static int save_sound(char *filename, struct sound *s, int channels, int format)
 {
 	SNDFILE *sf;
 	SF_INFO sfinfo;
@@ -86,7 +401,7 @@ int explodomatica_save_file(char *filename, struct sound *s, int channels)
 	sfinfo.frames = 0;
 	sfinfo.samplerate = SAMPLERATE;
 	sfinfo.channels = channels;
-	sfinfo.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
+	sfinfo.format = format;
 	sfinfo.sections = 0;
 	sfinfo.seekable = 1;
 
@@ -95,8 +410,15 @@ int explodomatica_save_file(char *filename, struct sound *s, int channels)
 		fprintf(stderr, "Cannot open '%s'\n", filename);
 		return -1;
 	}
-	sf_write_double(sf, s->data, s->nsamples);
+	sf_write_samples(sf, s->data, s->nsamples);
 	sf_close(sf);
+	return 0;
+}
+
+int explodomatica_save_file(char *filename, struct sound *s, int channels)
+{
+	if (save_sound(filename, s, channels, SF_FORMAT_WAV | SF_FORMAT_PCM_16) != 0)
+		return -1;
 	printf("Saved output in '%s'\n", filename);
 	return 0;
 }
@@ -120,60 +442,21 @@ static struct sound *make_sinewave(int nsamples, double frequency)
 }
 #endif
 
-static struct sound *add_sound(struct sound *s1, struct sound *s2)
-{
-	int i, n;
-	struct sound *s;
-
-	n = s1->nsamples;
-	if (s2->nsamples > n)
-		n = s2->nsamples;
-
-	s = malloc(sizeof(*s));
-	s->data = malloc(sizeof(*s->data) * n);
-	s->nsamples = 0;
-
-	for (i = 0; i < n; i++) {
-		s->data[i] = 0.0;
-		if (i < s1->nsamples)
-			s->data[i] += s1->data[i];
-		if (i < s2->nsamples)
-			s->data[i] += s2->data[i];
-		s->nsamples++;
-	}
-	return s;
-}
-
-static void accumulate_sound(struct sound *acc, struct sound *inc)
+/* Adds inc (which must be no longer than acc) into acc, and returns the
+ * peak absolute value of the mixed part.
+ */
+static double accumulate_sound(struct sound *acc, struct sound *inc)
 {
-	struct sound *t;
-
-	t = add_sound(acc, inc);
-	free_sound(acc);
-	acc->data = t->data;
-	acc->nsamples = t->nsamples;
-	free(t);
+	assert(inc->nsamples <= acc->nsamples);
+	return sample_kernels()->add_peak(acc->data, inc->data, inc->nsamples);
 }
 
-static void amplify_in_place(struct sound *s, double gain)
-{
-	int i;
-
-	for (i = 0; i < s->nsamples; i++) {
-		s->data[i] = s->data[i] * gain;
-		if (s->data[i] > 1.0)
-			s->data[i] = 1.0;
-		if (s->data[i] < -1.0)
-			s->data[i] = -1.0;
-	}
-}
+#define NOISE_GAIN 0.70
 
-static struct sound *make_noise(struct explosion_def *e, int nsamples)
+/* Fills s with nsamples of noise (s must have room for them) */
+static void make_noise(struct explosion_def *e, struct sound *s,
+	unsigned long long key, int nsamples)
 {
-	int i;
-	struct sound *s;
-	s = alloc_sound(nsamples);
-
 	/* If there is input data, use that rather than generating noise */
 	if (e->input_data) {
 		int n;
@@ -184,388 +467,3359 @@ static struct sound *make_noise(struct explosion_def *e, int nsamples)
 		memset(s->data, 0, sizeof(s->data[0]) * nsamples);
 		memcpy(s->data, e->input_data, n * sizeof(s->data[0]));
 		s->nsamples = nsamples;
-		return s;
+		return;
 	}
 		
 	/* generate noise */
-	for (i = 0; i < nsamples; i++) {
-		s->data[i] = 2.0 * drand() - 1.0;
-		s->nsamples++;
-	}
-	amplify_in_place(s, 0.70);
-	return s;
+	sample_kernels()->noise(s->data, nsamples, key, 0, 1, NOISE_GAIN);
+	s->nsamples = nsamples;
 }
 
 static void fadeout(struct sound *s, int nsamples)
 {
-	int i;
-	double factor;
-
-	for (i = 0; i < nsamples; i++) {
-		factor = 1.0 - ((double) i / (double) nsamples);
-		s->data[i] *= factor;	
-	}
-}	
+	sample_kernels()->fadeout(s->data, nsamples);
+}
 
-/* algorithm for low pass filter gleaned from wikipedia
- * and adapted for stereo samples
+/* Sliding low pass filter.  The algorithm for the one pole filter,
+ * y += alpha * (x - y), was gleaned from wikipedia.  Several of them
+ * are run as a cascade, in one pass, in place.  alpha slides from
+ * alpha1 * alpha1 to alpha2 * alpha2 over nsamples, its square root
+ * stepping along by the same amount each sample.  With biquad set,
+ * each stage is a second order Butterworth section instead, with
+ * the cutoff of the one pole filter it replaces, its coefficients
+ * recomputed every BIQUAD_UPDATE samples.  The first sample goes
+ * through unchanged.
  */
-static struct sound *sliding_low_pass(struct sound *s,
-	double alpha1, double alpha2)
+#define LOWPASS_MAX_STAGES 8
+#define BIQUAD_UPDATE 32
+
+struct lowpass {
+	int biquad;
+	int nstages;
+	int started;
+	double c, dc;		/* sqrt(alpha), and its change per sample */
+	sample_t y[LOWPASS_MAX_STAGES];
+	int countdown;		/* samples until the next coefficient update */
+	double b0, b1, b2, a1, a2;
+	double z1[LOWPASS_MAX_STAGES], z2[LOWPASS_MAX_STAGES];
+};
+
+static void lowpass_init(struct lowpass *f, int biquad, int nstages,
+		double alpha1, double alpha2, int nsamples)
 {
-	int i;
-	struct sound *o;
-	double alpha;
+	assert(nstages >= 0 && nstages <= LOWPASS_MAX_STAGES);
+	memset(f, 0, sizeof(*f));
+	f->biquad = biquad;
+	f->nstages = nstages;
+	f->c = alpha1;
+	f->dc = nsamples > 0 ? (alpha2 - alpha1) / (double) nsamples : 0.0;
+}
 
-	o = malloc(sizeof(*o));
-	o->data = malloc(sizeof(*o->data) * s->nsamples);
+/* Butterworth coefficients for the cutoff of a one pole filter */
+static void lowpass_biquad_coefficients(struct lowpass *f, double alpha)
+{
+	double w0, s, one_minus_cos, cosw, aq, a0;
+
+	/* the one pole filter's -3dB point is near -log(1 - alpha) */
+	w0 = alpha < 1.0 ? -log(1.0 - alpha) : M_PI;
+	if (w0 < 1e-6)
+		w0 = 1e-6;
+	if (w0 > 0.9 * M_PI)
+		w0 = 0.9 * M_PI;
+	s = sin(0.5 * w0);
+	one_minus_cos = 2.0 * s * s;
+	cosw = 1.0 - one_minus_cos;
+	aq = sin(w0) * M_SQRT1_2;	/* Q of 1/sqrt(2) */
+	a0 = 1.0 + aq;
+	f->b0 = 0.5 * one_minus_cos / a0;
+	f->b1 = one_minus_cos / a0;
+	f->b2 = f->b0;
+	f->a1 = -2.0 * cosw / a0;
+	f->a2 = (1.0 - aq) / a0;
+}
 
-	o->data[0] = s->data[0];
+static sample_t lowpass_next(struct lowpass *f, sample_t x)
+{
+	double alpha, y;
+	int k;
+
+	alpha = f->c * f->c;
+	f->c += f->dc;
+	if (!f->started) {
+		f->started = 1;
+		for (k = 0; k < f->nstages; k++)
+			f->y[k] = x;
+		if (f->biquad) {
+			/* start as if x had always been the input */
+			lowpass_biquad_coefficients(f, alpha);
+			f->countdown = BIQUAD_UPDATE;
+			for (k = 0; k < f->nstages; k++) {
+				f->z1[k] = x * (1.0 - f->b0);
+				f->z2[k] = x * (f->b2 - f->a2);
+			}
+		}
+		return x;
+	}
+	if (!f->biquad) {
+		for (k = 0; k < f->nstages; k++) {
+			f->y[k] = f->y[k] + alpha * (x - f->y[k]);
+			x = f->y[k];
+		}
+		return x;
+	}
+	if (--f->countdown == 0) {
+		lowpass_biquad_coefficients(f, alpha);
+		f->countdown = BIQUAD_UPDATE;
+	}
+	for (k = 0; k < f->nstages; k++) {
+		y = f->b0 * x + f->z1[k];
+		f->z1[k] = f->b1 * x - f->a1 * y + f->z2[k];
+		f->z2[k] = f->b2 * x - f->a2 * y;
+		x = y;
+	}
+	return x;
+}
 
-	assert(s->nsamples >= 2);
-	for (i = 1; i < s->nsamples;) {
-		alpha = ((double) i / (double) s->nsamples) *
-			(alpha2 - alpha1) + alpha1;
-		alpha = alpha * alpha;
-		o->data[i] = o->data[i - 1] + alpha * (s->data[i] - o->data[i - 1]);
-		i++;
+/* Low passes s in place, nstages times over, in as few passes as can be */
+/* Gives up part way if e is cancelled */
+static void sliding_low_pass(struct sound *s, int biquad, int nstages,
+		double alpha1, double alpha2, struct explosion_def *e)
+{
+	struct lowpass f;
+	int i, k;
+
+	for (k = 0; k < nstages; k += LOWPASS_MAX_STAGES) {
+		lowpass_init(&f, biquad, nstages - k < LOWPASS_MAX_STAGES ?
+				nstages - k : LOWPASS_MAX_STAGES,
+				alpha1, alpha2, s->nsamples);
+		for (i = 0; i < s->nsamples; i++) {
+			s->data[i] = lowpass_next(&f, s->data[i]);
+			if ((i + 1) % CANCEL_BLOCK == 0 && cancelled(e))
+				return;
+		}
 	}
-	o->nsamples = s->nsamples;
-	return o;
 }
 
-static void sliding_low_pass_inplace(struct sound *s, double alpha1, double alpha2)
+/* Resampler.  Output sample j comes from input position j * nin / nout,
+ * kept as a 32.32 fixed point phase which steps along by a constant.
+ * The linear mode interpolates between the two nearest input samples.
+ * The sinc mode convolves with a Kaiser windowed sinc, cut off at the
+ * lower of the input and output Nyquist frequencies.  It is tabulated
+ * at RESAMPLE_PHASES phases, and interpolated between the two nearest
+ * phases.  Beyond either end, the input repeats its end sample.
+ *
+ * Input is read in order into a window, and never further than it has
+ * to be.  That means it can come a sample at a time from a function.
+ * It also means that when speeding up, the output can overwrite the
+ * input as it goes, since output sample j is made after input sample j
+ * has been read.
+ */
+#define RESAMPLE_PHASE_BITS 5
+#define RESAMPLE_PHASES (1 << RESAMPLE_PHASE_BITS)
+#define RESAMPLE_ZERO_CROSSINGS 8	/* each side of the sinc's peak */
+#define RESAMPLE_MAX_HALF 1024		/* beyond 128x, cut off higher */
+#define RESAMPLE_KAISER_BETA 8.0
+#define RESAMPLE_WINDOW 1024		/* at least, in samples */
+
+struct resampler {
+	int nin, nout;
+	unsigned long long pos, step;	/* input position of the next output */
+	int sinc;
+	int half;		/* input samples each side of pos used */
+	int taps;		/* 2 * half */
+	sample_t *table;	/* RESAMPLE_PHASES + 1 rows of taps */
+	sample_t *w;		/* the window */
+	int wsize;
+	int wbase;		/* input sample held in w[0], less half - 1 */
+	int nread;		/* likewise, the next input sample to read */
+	sample_t first, last;
+	const sample_t *in;	/* where input comes from, in or next(src) */
+	sample_t (*next)(void *src);
+	void *src;
+};
+
+static int resampler_half(int nin, double factor, int sinc, double *cutoff)
 {
-	struct sound *o;
+	int nout, half;
+	double fc;
 
-	o = sliding_low_pass(s, alpha1, alpha2);
-	free_sound(s);
-	s->data = o->data;
-	s->nsamples = o->nsamples;
-	free(o);
+	if (!sinc) {
+		*cutoff = 1.0;
+		return 1;
+	}
+	nout = (int) (nin / factor);
+	fc = nout < nin && nin > 0 ? (double) nout / (double) nin : 1.0;
+	half = (int) ceil(RESAMPLE_ZERO_CROSSINGS / fc);
+	if (half > RESAMPLE_MAX_HALF) {
+		half = RESAMPLE_MAX_HALF;
+		fc = (double) RESAMPLE_ZERO_CROSSINGS / (double) half;
+	}
+	*cutoff = fc;
+	return half;
 }
 
-static double interpolate(double x, double x1, double y1, double x2, double y2)
+static int resampler_window(int half)
 {
-        /* return corresponding y on line x1,y1,x2,y2 for value x
-	 * (y2 -y1)/(x2 - x1) = (y - y1) / (x - x1)     by similar triangles.
-	 * (x -x1) * (y2 -y1)/(x2 -x1) = y - y1         a little algebra...
-	 * y = (x - x1) * (y2 - y1) / (x2 -x1) + y1;
-	 */
-	if (fabs(x2 - x1) < (0.01 * 1.0 / (double) SAMPLERATE))
-		return (y1 + y2) / 2.0;
-	return (x - x1) * (y2 - y1) / (x2 -x1) + y1;
+	return 4 * half > RESAMPLE_WINDOW ? 4 * half : RESAMPLE_WINDOW;
 }
 
-static struct sound *change_speed(struct sound *s, double factor)
+/* Bytes of memory resampler_init() needs */
+static size_t resampler_bytes(int nin, double factor, int sinc)
 {
-	struct sound *o;
-	int i, nsamples;
-	double sample_point;
-	int sp1, sp2;
+	double fc;
+	int half, ntable;
 
-	nsamples = (int) (s->nsamples / factor);
-	o = alloc_sound(nsamples);
+	half = resampler_half(nin, factor, sinc, &fc);
+	ntable = sinc ? (RESAMPLE_PHASES + 1) * 2 * half : 0;
+	return sizeof(sample_t) * (ntable + resampler_window(half));
+}
 
-	o->data[0] = s->data[0];
-	o->nsamples = 1;
+static double bessel_i0(double x)
+{
+	double sum = 1.0, term = 1.0;
+	int k;
 
-	for (i = 1; i < nsamples - 1; i++) {
-		sample_point = (double) i / (double) nsamples * (double) s->nsamples;
-		sp1 = (int) sample_point;
-		sp2 = sp1 + 1;
-		o->data[i] = interpolate(sample_point, (double) sp1, s->data[sp1], 
-						(double) sp2, s->data[sp2]);
-		o->nsamples++;
+	for (k = 1; k < 50 && term > sum * 1e-17; k++) {
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
 	}
-	o->data[nsamples - 1] = s->data[s->nsamples - 1];
-	return o;
+	return sum;
 }
 
-static void change_speed_inplace(struct sound *s, double factor)
+static void resampler_make_table(struct resampler *r, double fc)
 {
-	struct sound *o;
-
-	o = change_speed(s, factor);
-	free_sound(s);
-	s->data = o->data;
-	s->nsamples = o->nsamples;
+	double t, x, h, sum, *row;
+	int p, k;
+	sample_t *out;
+
+	/* Build each row in double, in the window, then normalize it */
+	row = (double *) r->w;
+	assert(sizeof(double) * r->taps <= sizeof(sample_t) * r->wsize);
+	for (p = 0; p <= RESAMPLE_PHASES; p++) {
+		sum = 0.0;
+		for (k = 0; k < r->taps; k++) {
+			t = k - (r->half - 1) - (double) p / RESAMPLE_PHASES;
+			x = t / r->half;
+			if (x <= -1.0 || x >= 1.0) {
+				row[k] = 0.0;
+				continue;
+			}
+			h = fabs(t) < 1e-9 ? fc : sin(M_PI * fc * t) / (M_PI * t);
+			h *= bessel_i0(RESAMPLE_KAISER_BETA * sqrt(1.0 - x * x));
+			row[k] = h;
+			sum += h;
+		}
+		out = &r->table[p * r->taps];
+		for (k = 0; k < r->taps; k++)
+			out[k] = row[k] / sum;
+	}
 }
 
-static struct sound *copy_sound(struct sound *s)
+/* Sets up r to resample nin samples by factor, in mem, which must have
+ * resampler_bytes() bytes.
+ */
+static void resampler_init(struct resampler *r, int nin, double factor,
+		int sinc, void *mem)
 {
-	struct sound *o;
+	double fc;
+
+	memset(r, 0, sizeof(*r));
+	r->nin = nin;
+	r->nout = (int) (nin / factor);
+	r->step = r->nout > 0 ? ((unsigned long long) nin << 32) / r->nout : 0;
+	r->sinc = sinc;
+	r->half = resampler_half(nin, factor, sinc, &fc);
+	r->taps = 2 * r->half;
+	r->wsize = resampler_window(r->half);
+	if (sinc) {
+		r->table = mem;
+		r->w = r->table + (RESAMPLE_PHASES + 1) * r->taps;
+		resampler_make_table(r, fc);
+	} else {
+		r->w = mem;
+	}
+}
 
-	o = alloc_sound(s->nsamples);
+/* Starts resampling, taking input from in[], or failing that next(src) */
+static void resampler_start(struct resampler *r, const sample_t *in,
+		sample_t (*next)(void *src), void *src)
+{
+	r->in = in;
+	r->next = next;
+	r->src = src;
+	r->pos = 0;
+	r->wbase = 0;
+	r->nread = 0;
+}
 
-	memcpy(o->data, s->data, sizeof(o->data[0]) * s->nsamples);
-	o->nsamples = s->nsamples;
-	return o;
+/* number of samples change_speed() makes */
+static int resampler_length(struct resampler *r)
+{
+	return r->nout > 1 ? r->nout - 1 : r->nout;
 }
 
-static void renormalize(struct sound *s)
+/* Drops input before sample keep from the window */
+static void resampler_slide(struct resampler *r, int keep)
 {
-	int i;
-	double max = 0.0;
+	int n;
 
-	for (i = 0; i < s->nsamples; i++)
-		if (fabs(s->data[i]) > max)
-			max = fabs(s->data[i]);
-	for (i = 0; i < s->nsamples; i++)
-		s->data[i] = s->data[i] / (1.05 * max);
+	if (keep <= r->wbase)
+		return;
+	if (keep > r->nread)
+		keep = r->nread;
+	n = r->nread - keep;
+	memmove(r->w, &r->w[keep - r->wbase], sizeof(*r->w) * n);
+	r->wbase = keep;
 }
 
-static void delay_effect_in_place(struct sound *s, int delay_samples)
+/* Reads input into the window, up to (not including) sample upto */
+static void resampler_read(struct resampler *r, int upto)
 {
-	int i, source;
-
-	for (i = s->nsamples - 1; i >= 0; i--) {
-		source = i - delay_samples;
-		if (s->nsamples > source) {
-			if (source > 0) {
-				s->data[i] = s->data[source];
-			} else {
-				s->data[i] = 0.0;
-			}
+	int m, n;
+	sample_t *w;
+
+	while (r->nread < upto) {
+		if (r->nread - r->wbase == r->wsize)
+			resampler_slide(r, upto - r->taps);
+		w = &r->w[r->nread - r->wbase];
+		m = r->nread - (r->half - 1);	/* the input sample */
+		if (r->nread == 0)
+			r->first = r->last = r->in ? r->in[0] : r->next(r->src);
+		if (m <= 0) {
+			*w = r->first;
+			r->nread++;
+		} else if (m >= r->nin) {
+			*w = r->last;
+			r->nread++;
+		} else if (r->in) {
+			/* read as far ahead as will fit, it's all safe to read */
+			n = r->wbase + r->wsize - r->nread;
+			if (n > r->nin - m)
+				n = r->nin - m;
+			memcpy(w, &r->in[m], sizeof(*w) * n);
+			r->nread += n;
+			r->last = r->in[m + n - 1];
+		} else {
+			*w = r->last = r->next(r->src);
+			r->nread++;
 		}
 	}
 }
 
-static void dot(void)
+static sample_t resampler_next(struct resampler *r)
 {
-	printf("."); fflush(stdout);
+	struct sample_kernels *k;
+	unsigned int frac, p;
+	const sample_t *x, *row;
+	double mu, d0, d1;
+	int i;
+
+	i = (int) (r->pos >> 32);
+	frac = (unsigned int) r->pos;
+	r->pos += r->step;
+	if (i + r->taps > r->nread)
+		resampler_read(r, i + r->taps);
+	x = &r->w[i - r->wbase];
+	if (!r->sinc)
+		return x[0] + (frac * (1.0 / 4294967296.0)) * ((double) x[1] - x[0]);
+	k = sample_kernels();
+	p = frac >> (32 - RESAMPLE_PHASE_BITS);
+	mu = (frac & ((1U << (32 - RESAMPLE_PHASE_BITS)) - 1)) *
+			(1.0 / (double) (1U << (32 - RESAMPLE_PHASE_BITS)));
+	row = &r->table[p * r->taps];
+	d0 = k->dot(row, x, r->taps);
+	d1 = k->dot(row + r->taps, x, r->taps);
+	return d0 + mu * (d1 - d0);
 }
 
-static void update_progress(float progress_inc)
+/* Resamples nin samples of in to out, returning the number of samples
+ * made.  When speeding up, in and out may be the same buffer.  mem is
+ * as for resampler_init().  Progress is as for stage_progress(), and
+ * if e is cancelled, only the samples made so far are counted.
+ */
+static int change_speed_samples(const sample_t *in, int nin, sample_t *out,
+		double factor, int sinc, void *mem,
+		struct explodomatica_context *ctx, struct explosion_def *e)
 {
-	if (!explodomatica_progress)
-		return;
-	*explodomatica_progress += progress_inc;
-	if (*explodomatica_progress > 1.05)
-		*explodomatica_progress = 0.0;
+	struct resampler r;
+	int i, j, n, count;
+
+	resampler_init(&r, nin, factor, sinc, mem);
+	resampler_start(&r, in, NULL, NULL);
+	n = resampler_length(&r);
+	for (i = 0; i < n; i += count) {
+		count = n - i < CANCEL_BLOCK ? n - i : CANCEL_BLOCK;
+		for (j = i; j < i + count; j++)
+			out[j] = resampler_next(&r);
+		if (stage_progress(ctx, e, (float) (i + count) / (float) n))
+			return i + count;
+	}
+	return n;
 }
 
-static struct sound *poor_mans_reverb(struct sound *s,
-	int early_refls, int late_refls)
+static struct sound *change_speed(struct explodomatica_context *ctx,
+		struct explosion_def *e, struct sound *s, double factor)
 {
-	int i, delay;
-	struct sound *echo, *echo2;
-	struct sound *withverb;
-	double gain;
-	float progress_inc = 1.0 / (float) (early_refls + late_refls);
+	struct sound *o;
+	struct arena_mark m;
+	void *mem;
+
+	o = alloc_sound(ctx, (int) (s->nsamples / factor));
+	m = arena_mark(ctx);
+	mem = arena_alloc(ctx, resampler_bytes(s->nsamples, factor, e->resample_sinc));
+	o->nsamples = change_speed_samples(s->data, s->nsamples, o->data,
+					factor, e->resample_sinc, mem, ctx, e);
+	arena_release(ctx, m);
+	return o;
+}
 
-	printf("Calculating poor man's reverb");
-	fflush(stdout);
-	withverb = alloc_sound(s->nsamples * 2);
-	for (i = 0; i < s->nsamples; i++)
-		withverb->data[i] = s->data[i];
-	dot();
-	withverb->nsamples = s->nsamples * 2;
-	echo = copy_sound(withverb);
-
-	for (i = 0; i < early_refls; i++) {
-		dot();
-		echo2 = sliding_low_pass(echo, 0.5, 0.5);
-		gain = drand() * 0.03 + 0.03;
-		amplify_in_place(echo, gain); 
-
-		/* 300 ms range */
-		delay = (3 * 4410 * (rand() & 0x0ffff)) / 0x0ffff;
-		delay_effect_in_place(echo2, delay);
-		accumulate_sound(withverb, echo2);
-		free_sound(echo2);
-		free(echo2);
-		update_progress(progress_inc);
-	}
-
-	for (i = 0; i < late_refls; i++) {
-		dot();
-		echo2 = sliding_low_pass(echo, 0.5, 0.2);
-		gain = drand() * 0.01 + 0.03;
-		amplify_in_place(echo, gain); 
-
-		/* 2000 ms range */
-		delay = (2 * 44100 * (rand() & 0x0ffff)) / 0x0ffff;
-		delay_effect_in_place(echo2, delay);
-		accumulate_sound(withverb, echo2);
-		free_sound(echo2);
-		free(echo2);
-		update_progress(progress_inc);
-	}
-	free_sound(echo);
-	free(echo);
-	printf("done\n");
-	return withverb;
+static void speed_up_inplace(struct sound *s, double factor, int sinc, void *mem,
+		struct explosion_def *e)
+{
+	assert(factor >= 1.0);
+	s->nsamples = change_speed_samples(s->data, s->nsamples, s->data,
+					factor, sinc, mem, NULL, e);
 }
 
-static struct sound *make_explosion(struct explosion_def *e, double seconds, int nlayers)
+/* Noise sped up by some factor, made directly at the sped up length
+ * rather than made in full and then resampled.  Linear interpolation
+ * only looks at the two input samples either side of each output, so
+ * only those are made, and the result is just as if all of it had
+ * been resampled.  The sinc resampler filters white noise down to the
+ * output band, leaving (near enough gaussian) white noise at the output
+ * rate with the power that passes the filter, so that is what is made
+ * instead, from a sum of 4 uniform random numbers.
+ */
+#define SPEED_NOISE_SUM 4
+
+struct speed_noise {
+	unsigned long long key;
+	unsigned long long pos, step;	/* as in struct resampler */
+	int nin, nout;
+	int next;		/* output sample made next */
+	int sinc;
+	double gain;
+};
+
+static void speed_noise_init(struct speed_noise *n, unsigned long long key,
+		int nin, double factor, int sinc)
 {
-	struct sound *s[10];
-	struct sound *t = NULL;
-	double a1, a2;
-	int i, j, iters;
+	double fc;
+
+	memset(n, 0, sizeof(*n));
+	n->key = key;
+	n->nin = nin;
+	n->nout = (int) (nin / factor);
+	n->step = n->nout > 0 ? ((unsigned long long) nin << 32) / n->nout : 0;
+	n->sinc = sinc;
+	resampler_half(nin, factor, 1, &fc);
+	n->gain = NOISE_GAIN * sqrt(fc / SPEED_NOISE_SUM);
+}
 
-	assert(nlayers > 0);
-	for (i = 0; i < nlayers; i++) {
-		t = make_noise(e, seconds_to_frames(seconds));
+/* Same as resampler_length() */
+static int speed_noise_length(struct speed_noise *n)
+{
+	return n->nout > 1 ? n->nout - 1 : n->nout;
+}
 
-		if (i > 0) 
-			change_speed_inplace(t, i * 2);
+static sample_t speed_noise_next(struct speed_noise *n)
+{
+	unsigned int frac;
+	sample_t x0, x1;
+	int i;
 
-		iters = i + 1;
-		if (iters > 3)
-			iters = 3;
-		for (j = 0; j < iters; j++)
-			fadeout(t, t->nsamples);
+	if (n->sinc)
+		return sample_noise(n->key, (unsigned int) n->next++,
+				SPEED_NOISE_SUM, n->gain);
+	i = (int) (n->pos >> 32);
+	frac = (unsigned int) n->pos;
+	n->pos += n->step;
+	x0 = sample_noise(n->key, (unsigned int) i, 1, NOISE_GAIN);
+	/* past the end, the last sample repeats */
+	x1 = i + 1 < n->nin ?
+		sample_noise(n->key, (unsigned int) i + 1, 1, NOISE_GAIN) : x0;
+	return x0 + (frac * (1.0 / 4294967296.0)) * ((double) x1 - x0);
+}
 
-		a1 = (double) (i + 1) / (double) nlayers;
-		a2 = (double) i / (double) nlayers;
+/* Fills d with the next count samples, as speed_noise_next() would.
+ * Unless most of it would be skipped, it's quicker to have the noise
+ * kernel make a block of noise at a time, and interpolate from that.
+ */
+#define SPEED_NOISE_BLOCK 1024
+#define SPEED_NOISE_SPARSE 8	/* factor beyond which noise is skipped */
 
-		iters = 3 - i; 
-		if (iters < 0)
-			iters = 1;	
-		for (j = 0; j < iters; j++) {
-			sliding_low_pass_inplace(t, a1, a2);
-			renormalize(t);
+static void speed_noise_fill(struct speed_noise *n, sample_t *d, int count)
+{
+	struct sample_kernels *k = sample_kernels();
+	sample_t in[SPEED_NOISE_BLOCK], x0, x1;
+	unsigned int frac;
+	int i, j, i0, avail;
+
+	if (n->sinc) {
+		k->noise(d, count, n->key, (unsigned int) n->next,
+				SPEED_NOISE_SUM, n->gain);
+		n->next += count;
+		return;
+	}
+	if ((n->step >> 32) >= SPEED_NOISE_SPARSE) {
+		for (j = 0; j < count; j++)
+			d[j] = speed_noise_next(n);
+		return;
+	}
+	j = 0;
+	while (j < count) {
+		i0 = (int) (n->pos >> 32);
+		avail = n->nin - i0 < SPEED_NOISE_BLOCK ? n->nin - i0 : SPEED_NOISE_BLOCK;
+		k->noise(in, avail, n->key, (unsigned int) i0, 1, NOISE_GAIN);
+		for (; j < count; j++) {
+			i = (int) (n->pos >> 32) - i0;
+			if (i + 1 >= avail && i0 + avail < n->nin)
+				break;	/* on to the next block */
+			x0 = in[i];
+			x1 = i + 1 < avail ? in[i + 1] : x0;
+			frac = (unsigned int) n->pos;
+			n->pos += n->step;
+			d[j] = x0 + (frac * (1.0 / 4294967296.0)) * ((double) x1 - x0);
 		}
-		s[i] = t;
 	}
+}
 
-	for (i = 1; i < nlayers; i++) {
-		accumulate_sound(s[0], s[i]);
-		free_sound(s[i]);
-	}
-	renormalize(s[0]);
-	return s[0];
+static struct sound *copy_sound(struct explodomatica_context *ctx, struct sound *s)
+{
+	struct sound *o;
+
+	o = alloc_sound(ctx, s->nsamples);
+
+	memcpy(o->data, s->data, sizeof(o->data[0]) * s->nsamples);
+	o->nsamples = s->nsamples;
+	return o;
 }
 
-static void trim_trailing_silence(struct sound *s)
+/* Scale s so its peak is just under 1.0, given its current peak */
+static void renormalize_peak(struct sound *s, double max)
 {
-	int i;
+	sample_kernels()->divide(s->data, s->nsamples, 1.05 * max);
+}
 
-	for (i = s->nsamples -1 ; i >= 0; i--) {
-		if (fabs(s->data[i]) < 0.00001)
-			s->nsamples--;
-	}
+static void renormalize(struct sound *s)
+{
+	renormalize_peak(s, sample_kernels()->peak(s->data, s->nsamples));
 }
 
-static struct sound *make_preexplosions(struct explosion_def *e)
+/* Mix inc into acc and renormalize, finding the peak while mixing */
+static void accumulate_and_renormalize(struct sound *acc, struct sound *inc)
 {
-	struct sound *pe;
-	int i;
+	double max;
 
-	if (!e->preexplosions)
-		return NULL;
+	max = accumulate_sound(acc, inc);
+	if (acc->nsamples > inc->nsamples)
+		max = fmax(max, sample_kernels()->peak(&acc->data[inc->nsamples],
+					acc->nsamples - inc->nsamples));
+	renormalize_peak(acc, max);
+}
 
-	pe = alloc_sound(seconds_to_frames(e->duration));
-	pe->nsamples = seconds_to_frames(e->duration);
-	for (i = 0; i < e->preexplosions; i++) {
-		struct sound *exp;
-		int offset;
-		exp = make_explosion(e, e->duration / 2, e->nlayers);
-		offset = irand(seconds_to_frames(e->preexplosion_delay));
-		delay_effect_in_place(exp, offset);
-		accumulate_sound(pe, exp);
-		renormalize(pe);
-		free_sound(exp);
-	}
-	for (i = 0 ; i < e->preexplosion_lp_iters; i++) {
-		sliding_low_pass_inplace(pe,
-			e->preexplosion_low_pass_factor,
-			e->preexplosion_low_pass_factor);
+/* Samples to be mixed into a sound at some offset, and with some gain,
+ * without first moving or scaling them.  Like a struct stream_gain's,
+ * the gain is kept as the divisor renormalize_peak() would use, so that
+ * mixing a view gives bit for bit what renormalizing the samples and
+ * then mixing them would have.
+ */
+struct sound_view {
+	const sample_t *data;
+	int nsamples;
+	int offset;		/* where data[0] goes in the sound mixed into */
+	double divisor;
+};
+
+/* A view of s, renormalized and delayed by delay_samples, as a
+ * pre-explosion is mixed in.  The length stays the same, so whatever is
+ * pushed off the end is dropped.  (So is s's first sample, as it always
+ * has been.)
+ */
+static struct sound_view delayed_view(struct sound *s, int delay_samples)
+{
+	struct sound_view v;
+
+	v.data = &s->data[1];
+	v.nsamples = s->nsamples - delay_samples - 1;
+	v.offset = delay_samples + 1;
+	if (v.nsamples < 0) {
+		v.nsamples = 0;
+		v.offset = s->nsamples;
 	}
-	renormalize(pe);
-	return pe;
+	v.divisor = 1.05 * sample_kernels()->peak(s->data, s->nsamples);
+	return v;
 }
 
-static void read_input_file(char *filename,
-	double **input_data, unsigned long long *input_samples)
+/* Mixes v into acc (which v must fit in) and renormalizes, as
+ * accumulate_and_renormalize() does, in a single pass over the mixed
+ * part of acc and a look at the peak of the rest.
+ */
+static void accumulate_view_and_renormalize(struct sound *acc, struct sound_view *v)
 {
-	SF_INFO sfi;
-	SNDFILE *sf;
-	unsigned long long nframes;
-	unsigned long long buffersize;
-	unsigned long long samples;
+	double max;
+
+	assert(v->offset >= 0 && v->offset + v->nsamples <= acc->nsamples);
+	max = sample_kernels()->peak(acc->data, v->offset);
+	max = fmax(max, sample_kernels()->add_divided_peak(&acc->data[v->offset],
+				v->data, v->nsamples, v->divisor));
+	max = fmax(max, sample_kernels()->peak(&acc->data[v->offset + v->nsamples],
+				acc->nsamples - v->offset - v->nsamples));
+	renormalize_peak(acc, max);
+}
 
-	memset(&sfi, 0, sizeof(sfi));
+/* Progress chatter on stdout, unless e->quiet */
+static void say(struct explosion_def *e, const char *fmt, ...)
+{
+	va_list ap;
 
-	sf = sf_open(filename, SFM_READ, &sfi);
-	if (!sf) {
-		fprintf(stderr, "explodomatica: Cannot open '%s' for reading: %s\n", 
+	if (e->quiet)
+		return;
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	fflush(stdout);
+}
+
+static void dot(struct explosion_def *e)
+{
+	say(e, ".");
+}
+
+/* Wall clock time in seconds, for struct explodomatica_stats */
+static double stats_clock(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double) t.tv_sec + (double) t.tv_nsec * 1e-9;
+}
+
+/* The reverb is a set of "taps", each of which is a low passed,
+ * attenuated and delayed copy of the dry signal.  All taps are
+ * computed together in a single pass over the output rather than
+ * building (and mixing in) a whole new buffer per reflection.
+ */
+struct reverb_tap {
+	int delay;	/* in samples */
+	double gain;	/* this reflection's attenuation */
+	double level;	/* accumulated gain applied to this tap */
+	int late;	/* early or late reflection? */
+	double *line;	/* per tap delay line, compat mode only */
+	double state;	/* per tap low pass filter state, compat mode only */
+};
+
+/* Taps quieter than this are way below the resolution of the
+ * 16 bit output and are skipped (except in compat mode).
+ */
+#define REVERB_MIN_TAP_LEVEL (1.0 / 1048576.0)
+#define REVERB_BLOCK 4096
+
+/* Once the dry signal has stopped, the filters decay towards zero, but
+ * stick at the smallest denormal, which every tap is then very slow to
+ * work with.  Anything this small is long since inaudible.
+ */
+#define REVERB_FLUSH 1e-20
+
+static int make_reverb_taps(struct explosion_def *e, struct reverb_tap *tap,
+		int early_refls, int late_refls)
+{
+	int i, n;
+	double level = 1.0;
+
+	/* Consume random numbers in the same order the old
+	 * one-buffer-per-reflection reverb did, so that a given
+	 * seed always produces the same room.
+	 */
+	n = 0;
+	for (i = 0; i < early_refls + late_refls; i++) {
+		tap[n].late = i >= early_refls;
+		if (!tap[n].late) {
+			tap[n].gain = drand(e) * 0.03 + 0.03;
+			/* 300 ms range */
+			tap[n].delay = irand(e, 3 * 4410);
+		} else {
+			tap[n].gain = drand(e) * 0.01 + 0.03;
+			/* 2000 ms range */
+			tap[n].delay = irand(e, 2 * 44100);
+		}
+		tap[n].level = level;
+		tap[n].state = 0.0;
+		level *= tap[n].gain;
+		n++;
+	}
+	return n;
+}
+
+/* Returns non-zero if the reverb should give up */
+static int reverb_block_done(struct explodomatica_context *ctx,
+		struct explosion_def *e, int i, int n)
+{
+	if ((i / REVERB_BLOCK) % 16 == 0)
+		dot(e);
+	i += REVERB_BLOCK;
+	return stage_progress(ctx, e, (float) (i < n ? i : n) / (float) n);
+}
+
+static double late_alpha(int i, int nsamples)
+{
+	double alpha;
+
+	alpha = ((double) i / (double) nsamples) * (0.2 - 0.5) + 0.5;
+	return alpha * alpha;
+}
+
+/* State of a multi-tap reverb, which is fed its input and produces
+ * its output a block at a time.  Memory used depends only on the
+ * number of taps and their delays, not on the length of the sound.
+ */
+struct tap_reverb {
+	struct reverb_tap *tap;
+	int ntaps;
+	int compat;
+	int n;		/* total length of the output */
+	int i;		/* index of the next output sample */
+	double early, late;	/* shared filter states, fast mode */
+	double *early_line, *late_line;
+	int mask;
+};
+
+/* Draws a new room, and starts the reverb over.  A delay line is only
+ * ever read where it has been written since, so they need no clearing.
+ */
+static void tap_reverb_restart(struct explosion_def *e, struct tap_reverb *r)
+{
+	int early_refls = e->reverb_early_refls;
+	int late_refls = e->reverb_late_refls;
+	int k;
+
+	if (early_refls < 0)
+		early_refls = 0;
+	if (late_refls < 0)
+		late_refls = 0;
+	r->ntaps = make_reverb_taps(e, r->tap, early_refls, late_refls);
+	r->i = 0;
+	r->early = 0.0;
+	r->late = 0.0;
+	if (r->compat)
+		return;
+
+	/* drop inaudible taps */
+	for (k = 0; k < r->ntaps; k++)
+		if (r->tap[k].level < REVERB_MIN_TAP_LEVEL)
+			break;
+	r->ntaps = k;
+}
+
+static void tap_reverb_init(struct explodomatica_context *ctx,
+		struct explosion_def *e, struct tap_reverb *r, int n)
+{
+	int early_refls = e->reverb_early_refls;
+	int late_refls = e->reverb_late_refls;
+	int k, maxdelay, linesize;
+	struct reverb_tap *tap;
+
+	if (early_refls < 0)
+		early_refls = 0;
+	if (late_refls < 0)
+		late_refls = 0;
+	memset(r, 0, sizeof(*r));
+	r->tap = tap = arena_alloc(ctx, sizeof(*tap) * (early_refls + late_refls + 1));
+	r->compat = e->reverb_compat;
+	r->n = n;
+	tap_reverb_restart(e, r);
+
+	if (r->compat) {
+		for (k = 0; k < r->ntaps; k++) {
+			tap[k].line = arena_alloc(ctx, sizeof(*tap[k].line) * (tap[k].delay + 1));
+			memset(tap[k].line, 0, sizeof(*tap[k].line) * (tap[k].delay + 1));
+		}
+		return;
+	}
+
+	maxdelay = 0;
+	for (k = 0; k < r->ntaps; k++)
+		if (tap[k].delay > maxdelay)
+			maxdelay = tap[k].delay;
+	linesize = 1;
+	while (linesize <= maxdelay)
+		linesize <<= 1;
+	r->mask = linesize - 1;
+	r->early_line = arena_alloc(ctx, sizeof(*r->early_line) * linesize);
+	r->late_line = arena_alloc(ctx, sizeof(*r->late_line) * linesize);
+	memset(r->early_line, 0, sizeof(*r->early_line) * linesize);
+	memset(r->late_line, 0, sizeof(*r->late_line) * linesize);
+}
+
+/* Like tap_reverb_init(), but with delay lines long enough for any room,
+ * so that tap_reverb_restart() can draw another.  The room is drawn by
+ * the first tap_reverb_restart().  The lines are cleared anyway, so that
+ * their memory is all there before the reverb runs.
+ */
+static void tap_reverb_init_any(struct explodomatica_context *ctx,
+		struct explosion_def *e, struct tap_reverb *r, int n)
+{
+	int early_refls = e->reverb_early_refls;
+	int late_refls = e->reverb_late_refls;
+	int k, delay;
+
+	if (early_refls < 0)
+		early_refls = 0;
+	if (late_refls < 0)
+		late_refls = 0;
+	memset(r, 0, sizeof(*r));
+	r->tap = arena_alloc(ctx, sizeof(*r->tap) * (early_refls + late_refls + 1));
+	r->compat = e->reverb_compat;
+	r->n = n;
+	if (r->compat) {
+		/* as make_reverb_taps() draws them */
+		for (k = 0; k < early_refls + late_refls; k++) {
+			delay = k < early_refls ? 3 * 4410 : 2 * 44100;
+			r->tap[k].line = arena_alloc(ctx,
+					sizeof(*r->tap[k].line) * (delay + 1));
+			memset(r->tap[k].line, 0, sizeof(*r->tap[k].line) * (delay + 1));
+		}
+		return;
+	}
+	r->mask = 131072 - 1;
+	r->early_line = arena_alloc(ctx, sizeof(*r->early_line) * (r->mask + 1));
+	r->late_line = arena_alloc(ctx, sizeof(*r->late_line) * (r->mask + 1));
+	memset(r->early_line, 0, sizeof(*r->early_line) * (r->mask + 1));
+	memset(r->late_line, 0, sizeof(*r->late_line) * (r->mask + 1));
+}
+
+/* An upper bound on what tap_reverb_init() allocates */
+static size_t tap_reverb_bytes(struct explosion_def *e)
+{
+	size_t early = e->reverb_early_refls > 0 ? e->reverb_early_refls : 0;
+	size_t late = e->reverb_late_refls > 0 ? e->reverb_late_refls : 0;
+
+	if (e->reverb_compat)
+		return arena_bytes(sizeof(struct reverb_tap) * (early + late + 1)) +
+			early * arena_bytes(sizeof(double) * (3 * 4410 + 1)) +
+			late * arena_bytes(sizeof(double) * (2 * 44100 + 1));
+	return arena_bytes(sizeof(struct reverb_tap) * (early + late + 1)) +
+		2 * arena_bytes(sizeof(double) * 131072);
+}
+
+/* Reproduces the old reverb exactly: each tap has its own low pass
+ * filter running on its own (repeatedly amplified) copy of the signal,
+ * and its own delay line.
+ */
+static void multitap_reverb_compat(struct tap_reverb *r,
+		const sample_t *in, sample_t *out, int count)
+{
+	struct reverb_tap *tap = r->tap;
+	int i, j, k;
+	double x, echo, v, alpha_early, alpha_late, alpha;
+
+	alpha_early = 0.5 * 0.5;
+
+	for (j = 0; j < count; j++) {
+		i = r->i + j;
+		x = in[j];
+		alpha_late = late_alpha(i, r->n);
+		out[j] = x;
+		echo = x;
+		for (k = 0; k < r->ntaps; k++) {
+			alpha = tap[k].late ? alpha_late : alpha_early;
+			if (i == 0)
+				tap[k].state = echo;
+			else
+				tap[k].state = tap[k].state + alpha * (echo - tap[k].state);
+			/* tap[k].line[] holds the last delay + 1 filter outputs */
+			tap[k].line[i % (tap[k].delay + 1)] = tap[k].state;
+			if (i - tap[k].delay > 0)
+				v = tap[k].line[(i - tap[k].delay) % (tap[k].delay + 1)];
+			else
+				v = 0.0;
+			out[j] = (0.0 + out[j]) + v;
+			echo = echo * tap[k].gain;
+			if (echo > 1.0)
+				echo = 1.0;
+			if (echo < -1.0)
+				echo = -1.0;
+		}
+	}
+	r->i += count;
+}
+
+/* Since the low pass filters are linear and all early (resp. late)
+ * taps use the same filter, the whole thing collapses to two filters
+ * feeding two shared delay lines, which all the taps read from.
+ */
+static void multitap_reverb(struct tap_reverb *r,
+		const sample_t *in, sample_t *out, int count)
+{
+	struct reverb_tap *tap = r->tap;
+	int i, j, k, mask = r->mask;
+	double x, early, late, acc;
+
+	early = r->early;
+	late = r->late;
+	for (j = 0; j < count; j++) {
+		i = r->i + j;
+		x = in[j];
+		if (i == 0) {
+			early = late = x;
+		} else {
+			early = early + 0.25 * (x - early);
+			late = late + late_alpha(i, r->n) * (x - late);
+			if (fabs(early) < REVERB_FLUSH)
+				early = 0.0;
+			if (fabs(late) < REVERB_FLUSH)
+				late = 0.0;
+		}
+		r->early_line[i & mask] = early;
+		r->late_line[i & mask] = late;
+		acc = x;
+		for (k = 0; k < r->ntaps; k++) {
+			if (i - tap[k].delay <= 0)
+				continue;
+			if (tap[k].late)
+				acc += tap[k].level * r->late_line[(i - tap[k].delay) & mask];
+			else
+				acc += tap[k].level * r->early_line[(i - tap[k].delay) & mask];
+		}
+		out[j] = acc;
+	}
+	r->early = early;
+	r->late = late;
+	r->i += count;
+}
+
+static void tap_reverb_process(struct tap_reverb *r,
+		const sample_t *in, sample_t *out, int count)
+{
+	if (r->compat)
+		multitap_reverb_compat(r, in, out, count);
+	else
+		multitap_reverb(r, in, out, count);
+}
+
+static struct sound *poor_mans_reverb(struct explodomatica_context *ctx,
+		struct explosion_def *e, struct sound *s)
+{
+	struct sound *withverb;
+	struct tap_reverb r;
+	sample_t tail[REVERB_BLOCK];
+	int i, n, count;
+
+	say(e, "Calculating poor man's reverb");
+
+	n = s->nsamples * 2;
+	withverb = alloc_sound(ctx, n);
+	withverb->nsamples = n;
+	tap_reverb_init(ctx, e, &r, n);
+	memset(tail, 0, sizeof(tail));
+	for (i = 0; i < n; i += count) {
+		count = n - i;
+		if (count > REVERB_BLOCK)
+			count = REVERB_BLOCK;
+		if (i + count <= s->nsamples) {
+			tap_reverb_process(&r, &s->data[i], &withverb->data[i], count);
+		} else {
+			/* past the end of the dry signal, the input is silence */
+			if (i < s->nsamples)
+				memcpy(tail, &s->data[i],
+					sizeof(tail[0]) * (s->nsamples - i));
+			tap_reverb_process(&r, tail, &withverb->data[i], count);
+			memset(tail, 0, sizeof(tail));
+		}
+		if (reverb_block_done(ctx, e, i, n)) {
+			withverb->nsamples = i + count;
+			break;
+		}
+	}
+	say(e, "done\n");
+	return withverb;
+}
+
+/* In place iterative radix-2 complex FFT.  n must be a power of two,
+ * and twr, twi the n / 2 twiddle factors fft_twiddles() makes for it.
+ * The inverse transform is not scaled by 1/n.
+ */
+static void fft(double *re, double *im, int n, const double *twr,
+		const double *twi, int inverse)
+{
+	int i, j, k, len, step;
+	double wr, wi, ur, ui, tr, ti, t;
+
+	for (i = 1, j = 0; i < n; i++) {
+		k = n >> 1;
+		while (j & k) {
+			j ^= k;
+			k >>= 1;
+		}
+		j |= k;
+		if (i < j) {
+			t = re[i]; re[i] = re[j]; re[j] = t;
+			t = im[i]; im[i] = im[j]; im[j] = t;
+		}
+	}
+
+	for (len = 2; len <= n; len <<= 1) {
+		step = n / len;
+		for (k = 0; k < len / 2; k++) {
+			wr = twr[k * step];
+			wi = inverse ? -twi[k * step] : twi[k * step];
+			for (i = k; i < n; i += len) {
+				j = i + len / 2;
+				tr = re[j] * wr - im[j] * wi;
+				ti = re[j] * wi + im[j] * wr;
+				ur = re[i];
+				ui = im[i];
+				re[i] = ur + tr;
+				im[i] = ui + ti;
+				re[j] = ur - tr;
+				im[j] = ui - ti;
+			}
+		}
+	}
+}
+
+/* The forward transform's twiddle factors, e^(-2 pi i k / n) for k < n / 2 */
+static void fft_twiddles(double *twr, double *twi, int n)
+{
+	int k;
+
+	for (k = 0; k < n / 2; k++) {
+		twr[k] = cos(-2.0 * M_PI * k / (double) n);
+		twi[k] = sin(-2.0 * M_PI * k / (double) n);
+	}
+}
+
+/* Convolution reverb, using uniformly partitioned overlap-save FFT
+ * convolution.  The impulse response is cut into block sized
+ * partitions, each transformed once.  Each block of input is transformed
+ * once, and kept in a frequency domain delay line so that every output
+ * block is just a sum of products of spectra and one inverse FFT.
+ * Cost depends only on the lengths of the sound and the impulse response,
+ * and memory only on the length of the impulse response.
+ *
+ * Rendering uses CONV_BLOCK sized blocks.  The realtime engine uses
+ * REALTIME_BLOCK sized ones: more partitions cost more per sample, but
+ * the work is the same for every block, where with CONV_BLOCK one
+ * callback in sixteen would do two 8192 point FFTs.
+ */
+#define CONV_BLOCK 4096
+
+struct conv_reverb {
+	int block, nparts, fftsize, nbins;
+	int b;			/* index of the next block */
+	double *hre, *him;	/* impulse response partition spectra */
+	double *xre, *xim;	/* frequency domain delay line */
+	double *yre, *yim;
+	double *twr, *twi;	/* fft() twiddle factors */
+	sample_t *prev;		/* previous block of input */
+};
+
+/* Starts the convolution over.  Only the spectra of blocks since the
+ * start are ever used, so the frequency domain delay line needs no
+ * clearing.
+ */
+static void conv_reverb_restart(struct conv_reverb *c)
+{
+	c->b = 0;
+	memset(c->prev, 0, sizeof(*c->prev) * c->block);
+}
+
+/* block, a power of two, is how many samples conv_reverb_process() takes */
+static void conv_reverb_init(struct explodomatica_context *ctx,
+		struct explosion_def *e, struct conv_reverb *c, int block)
+{
+	int i, p, ncopy, fftsize, nparts;
+	double *h, norm;
+	sample_t *ir = e->ir_data;
+	int irlen = (int) e->ir_samples;
+
+	c->block = block;
+	c->fftsize = fftsize = 2 * block;
+	c->nbins = fftsize / 2 + 1;
+	c->nparts = nparts = (irlen + block - 1) / block;
+	c->prev = arena_alloc(ctx, sizeof(*c->prev) * block);
+	c->twr = arena_alloc(ctx, sizeof(*c->twr) * fftsize / 2);
+	c->twi = arena_alloc(ctx, sizeof(*c->twi) * fftsize / 2);
+	fft_twiddles(c->twr, c->twi, fftsize);
+	conv_reverb_restart(c);
+
+	/* Scale the impulse response to unit energy so that loud and
+	 * quiet impulse responses give roughly the same output level.
+	 */
+	norm = 0.0;
+	for (i = 0; i < irlen; i++)
+		norm += ir[i] * ir[i];
+	norm = norm > 0.0 ? 1.0 / sqrt(norm) : 0.0;
+
+	c->hre = arena_alloc(ctx, sizeof(*c->hre) * fftsize * nparts);
+	c->him = arena_alloc(ctx, sizeof(*c->him) * fftsize * nparts);
+	c->xre = arena_alloc(ctx, sizeof(*c->xre) * fftsize * nparts);
+	c->xim = arena_alloc(ctx, sizeof(*c->xim) * fftsize * nparts);
+	c->yre = arena_alloc(ctx, sizeof(*c->yre) * fftsize);
+	c->yim = arena_alloc(ctx, sizeof(*c->yim) * fftsize);
+	memset(c->xre, 0, sizeof(*c->xre) * fftsize * nparts);
+	memset(c->xim, 0, sizeof(*c->xim) * fftsize * nparts);
+
+	for (p = 0; p < nparts; p++) {
+		h = &c->hre[p * fftsize];
+		memset(h, 0, sizeof(*h) * fftsize);
+		memset(&c->him[p * fftsize], 0, sizeof(*c->him) * fftsize);
+		ncopy = irlen - p * block;
+		if (ncopy > block)
+			ncopy = block;
+		for (i = 0; i < ncopy; i++)
+			h[i] = ir[p * block + i] * norm;
+		fft(h, &c->him[p * fftsize], fftsize, c->twr, c->twi, 0);
+	}
+}
+
+/* An upper bound on what conv_reverb_init() allocates for block, including
+ * the struct conv_reverb itself.
+ */
+static size_t conv_reverb_bytes(struct explosion_def *e, int block)
+{
+	size_t nparts = (e->ir_samples + block - 1) / block;
+
+	return arena_bytes(sizeof(struct conv_reverb)) +
+		4 * arena_bytes(sizeof(double) * 2 * block * nparts) +
+		4 * arena_bytes(sizeof(double) * 2 * block) +
+		arena_bytes(sizeof(sample_t) * block);
+}
+
+/* Feeds c->block samples of input in, gets c->block samples of
+ * (unnormalized) output out.
+ */
+static void conv_reverb_process(struct conv_reverb *c, const sample_t *in, sample_t *out)
+{
+	int i, p, b = c->b, block = c->block;
+	int fftsize = c->fftsize, nparts = c->nparts;
+	double *x, *yre = c->yre, *yim = c->yim;
+
+	/* transform the previous and current input blocks into the
+	 * frequency domain delay line
+	 */
+	x = &c->xre[(b % nparts) * fftsize];
+	memset(&c->xim[(b % nparts) * fftsize], 0, sizeof(*c->xim) * fftsize);
+	for (i = 0; i < block; i++) {
+		x[i] = c->prev[i];
+		x[block + i] = in[i];
+	}
+	memcpy(c->prev, in, sizeof(*c->prev) * block);
+	fft(x, &c->xim[(b % nparts) * fftsize], fftsize, c->twr, c->twi, 0);
+
+	/* Output spectrum is sum of input spectra times partition spectra.
+	 * Input is real, so only the first half of the bins are computed,
+	 * the rest are their complex conjugates.
+	 */
+	memset(yre, 0, sizeof(*yre) * fftsize);
+	memset(yim, 0, sizeof(*yim) * fftsize);
+	for (p = 0; p < nparts && p <= b; p++) {
+		double *ar = &c->xre[((b - p) % nparts) * fftsize];
+		double *ai = &c->xim[((b - p) % nparts) * fftsize];
+		double *br = &c->hre[p * fftsize];
+		double *bi = &c->him[p * fftsize];
+
+		for (i = 0; i < c->nbins; i++) {
+			yre[i] += ar[i] * br[i] - ai[i] * bi[i];
+			yim[i] += ar[i] * bi[i] + ai[i] * br[i];
+		}
+	}
+	for (i = c->nbins; i < fftsize; i++) {
+		yre[i] = yre[fftsize - i];
+		yim[i] = -yim[fftsize - i];
+	}
+	fft(yre, yim, fftsize, c->twr, c->twi, 1);
+
+	/* The second half is the part not polluted by circular wrap around.
+	 * The dry signal is mixed in, as the tap reverb does, so the impulse
+	 * response is just the room.
+	 */
+	for (i = 0; i < block; i++)
+		out[i] = in[i] + yre[block + i] / (double) fftsize;
+	c->b++;
+}
+
+static struct sound *convolution_reverb(struct explodomatica_context *ctx,
+		struct explosion_def *e, struct sound *s)
+{
+	struct sound *o;
+	struct conv_reverb *c;
+	sample_t in[CONV_BLOCK];
+	int b, nblocks, start, ncopy;
+	int irlen = (int) e->ir_samples;
+
+	say(e, "Calculating convolution reverb");
+
+	nblocks = (s->nsamples + irlen - 1 + CONV_BLOCK - 1) / CONV_BLOCK;
+
+	c = arena_alloc(ctx, sizeof(*c));
+	conv_reverb_init(ctx, e, c, CONV_BLOCK);
+	o = alloc_sound(ctx, nblocks * CONV_BLOCK);
+	for (b = 0; b < nblocks; b++) {
+		start = b * CONV_BLOCK;
+		ncopy = s->nsamples - start;
+		if (ncopy > CONV_BLOCK)
+			ncopy = CONV_BLOCK;
+		if (ncopy < 0)
+			ncopy = 0;
+		memset(in, 0, sizeof(in));
+		if (ncopy > 0)
+			memcpy(in, &s->data[start], sizeof(in[0]) * ncopy);
+		conv_reverb_process(c, in, &o->data[start]);
+		o->nsamples += CONV_BLOCK;
+		if (b % 16 == 0)
+			dot(e);
+		if (stage_progress(ctx, e, (float) (b + 1) / (float) nblocks))
+			break;
+	}
+	if (b == nblocks) {
+		o->nsamples = s->nsamples + irlen - 1;
+		renormalize(o);
+	}
+	say(e, "done\n");
+	return o;
+}
+
+static void trim_trailing_silence(struct sound *s)
+{
+	int i;
+
+	for (i = s->nsamples -1 ; i >= 0; i--) {
+		if (fabs(s->data[i]) < 0.00001)
+			s->nsamples--;
+	}
+}
+
+/* Every layer, of the pre-explosions as well as the main explosion, is
+ * made from its own seed, independently of the others, so the layers
+ * can be made at the same time by a pool of threads.  They are still
+ * mixed one at a time, in the order they were once made in, so the
+ * result is the same however many threads there are.  Layers are made
+ * in a ring of scratch buffers, which limits how far ahead of the
+ * mixing the threads can get.
+ */
+struct layer_task {
+	unsigned long long seed;
+	int layer;
+	int nlayers;
+	int nsamples;
+};
+
+/* Scratch space for making a layer in */
+struct layer_slot {
+	struct sound *t;
+	void *resampler;	/* for resampler_init() */
+	size_t resampler_bytes;
+};
+
+struct layer_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* a task may be startable, or it's time to quit */
+	pthread_cond_t done;	/* a task has been finished */
+	pthread_t *thread;
+	int nthreads;
+	int quit;
+
+	/* the layers being made now, if any */
+	struct explosion_def *e;
+	struct layer_task *task;
+	char *finished;
+	int ntasks;
+	int next;		/* next task to start */
+	int mixed;		/* tasks mixed so far */
+	struct layer_slot *slot;
+	int nslots;
+};
+
+/* Length of layer i, made from nsamples of noise.  With enough layers,
+ * the last are sped up so much that hardly anything is left of them,
+ * and layers of less than 2 samples are left out altogether.
+ */
+static int layer_length(int nsamples, int i)
+{
+	int n;
+
+	if (i == 0)
+		return nsamples >= 2 ? nsamples : 0;
+	n = (int) (nsamples / (double) (i * 2));
+	n = n > 1 ? n - 1 : n;	/* as change_speed_samples() does */
+	return n >= 2 ? n : 0;
+}
+
+/* Makes a layer, or some of one, if e is cancelled part way */
+static void make_layer(struct explosion_def *e, struct layer_slot *slot,
+		struct layer_task *task)
+{
+	struct sound *t = slot->t;
+	struct speed_noise n;
+	double a1, a2;
+	int i, j, iters, count;
+
+	i = task->layer;
+	if (layer_length(task->nsamples, i) == 0 || cancelled(e)) {
+		t->nsamples = 0;
+		return;
+	}
+	if (i > 0 && !e->input_data) {
+		speed_noise_init(&n, task->seed, task->nsamples, i * 2, e->resample_sinc);
+		t->nsamples = speed_noise_length(&n);
+		for (j = 0; j < t->nsamples; j += count) {
+			count = t->nsamples - j < CANCEL_BLOCK ?
+				t->nsamples - j : CANCEL_BLOCK;
+			speed_noise_fill(&n, &t->data[j], count);
+			if (cancelled(e))
+				return;
+		}
+	} else {
+		make_noise(e, t, task->seed, task->nsamples);
+	}
+
+	if (i > 0 && e->input_data) {
+		assert(resampler_bytes(t->nsamples, i * 2, e->resample_sinc) <=
+			slot->resampler_bytes);
+		speed_up_inplace(t, i * 2, e->resample_sinc, slot->resampler, e);
+	}
+	if (cancelled(e))
+		return;
+
+	iters = i + 1;
+	if (iters > 3)
+		iters = 3;
+	for (j = 0; j < iters; j++)
+		fadeout(t, t->nsamples);
+
+	a1 = (double) (i + 1) / (double) task->nlayers;
+	a2 = (double) i / (double) task->nlayers;
+
+	/* Renormalizing between stages would make no difference, as the
+	 * filters are linear, so the stages are all run at once.
+	 */
+	iters = 3 - i; 
+	if (iters < 0)
+		iters = 1;	
+	if (iters > 0) {
+		sliding_low_pass(t, e->lowpass_biquad, iters, a1, a2, e);
+		renormalize(t);
+	}
+}
+
+static void *layer_worker(void *arg)
+{
+	struct layer_pool *p = arg;
+	int k;
+
+	pthread_mutex_lock(&p->lock);
+	while (!p->quit) {
+		/* slot k % nslots is free once task k - nslots is mixed */
+		if (p->next >= p->ntasks || p->next >= p->mixed + p->nslots) {
+			pthread_cond_wait(&p->work, &p->lock);
+			continue;
+		}
+		k = p->next++;
+		pthread_mutex_unlock(&p->lock);
+		make_layer(p->e, &p->slot[k % p->nslots], &p->task[k]);
+		pthread_mutex_lock(&p->lock);
+		p->finished[k] = 1;
+		pthread_cond_signal(&p->done);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/* Starts a pool of nthreads threads, counting its malloc()s in *heap_allocs */
+static struct layer_pool *layer_pool_new(int nthreads, unsigned long *heap_allocs)
+{
+	struct layer_pool *p;
+	int i;
+
+	p = malloc(sizeof(*p));
+	if (!p)
+		out_of_memory(sizeof(*p));
+	(*heap_allocs)++;
+	memset(p, 0, sizeof(*p));
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->work, NULL);
+	pthread_cond_init(&p->done, NULL);
+	p->thread = malloc(sizeof(*p->thread) * nthreads);
+	if (!p->thread)
+		out_of_memory(sizeof(*p->thread) * nthreads);
+	(*heap_allocs)++;
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&p->thread[i], NULL, layer_worker, p) != 0)
+			break;
+	}
+	p->nthreads = i;
+	return p;
+}
+
+static void layer_pool_free(struct layer_pool *p)
+{
+	int i;
+
+	if (!p)
+		return;
+	pthread_mutex_lock(&p->lock);
+	p->quit = 1;
+	pthread_cond_broadcast(&p->work);
+	pthread_mutex_unlock(&p->lock);
+	for (i = 0; i < p->nthreads; i++)
+		pthread_join(p->thread[i], NULL);
+	pthread_cond_destroy(&p->done);
+	pthread_cond_destroy(&p->work);
+	pthread_mutex_destroy(&p->lock);
+	free(p->thread);
+	free(p);
+}
+
+/* The context's pool, started (or restarted) with nthreads threads */
+static struct layer_pool *context_pool(struct explodomatica_context *ctx,
+		int nthreads)
+{
+	if (ctx->pool && ctx->pool->nthreads == nthreads)
+		return ctx->pool;
+	layer_pool_free(ctx->pool);
+	ctx->pool = layer_pool_new(nthreads, &ctx->stats.heap_allocs);
+	if (ctx->pool->nthreads > 0)
+		return ctx->pool;
+	layer_pool_free(ctx->pool);	/* couldn't start any threads */
+	ctx->pool = NULL;
+	return NULL;
+}
+
+/* Number of threads to make e's layers with, not counting the caller's */
+static int layer_threads(struct explosion_def *e, int ntasks)
+{
+	int n;
+
+	n = e->threads;
+	if (n <= 0)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > ntasks)
+		n = ntasks;
+	return n > 1 ? n : 0;
+}
+
+static int layer_slots(int nthreads)
+{
+	return nthreads > 0 ? 2 * nthreads : 1;
+}
+
+/* Mixes layer[0..m-1], made from tasks k to k + m - 1 */
+typedef void (*layer_mixer)(int k, int m, struct sound **layer, void *arg);
+
+/* Makes the layers in task[], calling mix() with them in order.  Layers
+ * which are finished one after another are handed to mix() together.
+ * The layers are made by p's threads, or without p, by the caller.
+ * run[] must have room for nslots layers.  Returns non-zero if e was
+ * cancelled part way.
+ */
+static int make_layers(struct layer_pool *p, struct explosion_def *e,
+		struct layer_task *task, int ntasks, char *finished,
+		struct layer_slot *slot, int nslots, struct sound **run,
+		layer_mixer mix, void *arg)
+{
+	int k, m, gave_up = 0;
+
+	if (!p) {
+		for (k = 0; k < ntasks; k++) {
+			make_layer(e, &slot[0], &task[k]);
+			if (cancelled(e))
+				return 1;
+			mix(k, 1, &slot[0].t, arg);
+		}
+		return 0;
+	}
+
+	memset(finished, 0, ntasks);
+	pthread_mutex_lock(&p->lock);
+	p->e = e;
+	p->task = task;
+	p->finished = finished;
+	p->slot = slot;
+	p->nslots = nslots;
+	p->next = 0;
+	p->mixed = 0;
+	p->ntasks = ntasks;
+	pthread_cond_broadcast(&p->work);
+	for (k = 0; k < ntasks; k += m) {
+		while (!p->finished[k])
+			pthread_cond_wait(&p->done, &p->lock);
+		if (cancelled(e)) {
+			gave_up = 1;
+			break;
+		}
+		for (m = 0; m < nslots && k + m < ntasks && p->finished[k + m]; m++)
+			run[m] = slot[(k + m) % nslots].t;
+		pthread_mutex_unlock(&p->lock);
+		mix(k, m, run, arg);
+		pthread_mutex_lock(&p->lock);
+		p->mixed = k + m;
+		pthread_cond_broadcast(&p->work);
+	}
+	/* start nothing more, and wait for whatever was started */
+	p->ntasks = p->next;
+	for (; k < p->ntasks; k++)
+		while (!p->finished[k])
+			pthread_cond_wait(&p->done, &p->lock);
+	p->ntasks = 0;
+	p->next = 0;
+	p->mixed = 0;
+	p->task = NULL;
+	pthread_mutex_unlock(&p->lock);
+	return gave_up;
+}
+
+/* Mixes m layers into acc in a single pass over it.  Every sample is
+ * summed in layer order, so the result is just what mixing the layers
+ * in one at a time would give.  in[] must have room for m pointers.
+ */
+static void mix_layers(struct sound *acc, struct sound **layer, int m,
+		const sample_t **in)
+{
+	int i, n, start, end;
+
+	for (start = 0;; start = end) {
+		/* the layers still going at start, until the next one ends */
+		n = 0;
+		end = INT_MAX;
+		for (i = 0; i < m; i++) {
+			assert(layer[i]->nsamples <= acc->nsamples);
+			if (layer[i]->nsamples <= start)
+				continue;
+			in[n++] = &layer[i]->data[start];
+			if (layer[i]->nsamples < end)
+				end = layer[i]->nsamples;
+		}
+		if (n == 0)
+			break;
+		sample_kernels()->add_n(&acc->data[start], in, n, end - start);
+	}
+}
+
+struct explosion_mix {
+	struct explodomatica_context *ctx;	/* for stage_progress() */
+	struct explosion_def *e;
+	int nlayers;
+	int npre;
+	int ntasks;
+	int *offset;		/* delay of each pre-explosion */
+	const sample_t **in;	/* for mix_layers() */
+	struct sound *pe;	/* the pre-explosions */
+	struct sound *exp;	/* the pre-explosion being mixed */
+	struct sound *s;	/* the main explosion */
+	double preexplosions_done;	/* stats_clock() when they were */
+	unsigned long long samples;	/* in the layers mixed */
+};
+
+/* Mixes layers k to k + m - 1 into their explosions, finishing off
+ * each explosion as its last layer goes in.
+ */
+static void mix_explosion_layers(int k, int m, struct sound **t, void *arg)
+{
+	struct explosion_mix *x = arg;
+	struct sound_view v;
+	int n, j;
+
+	stage_progress(x->ctx, x->e, (float) (k + m) / (float) x->ntasks);
+	for (n = 0; n < m; n++)
+		x->samples += t[n]->nsamples;
+	while (m > 0) {
+		n = k / x->nlayers;
+		j = x->nlayers - k % x->nlayers;
+		if (j > m)
+			j = m;
+		mix_layers(n == x->npre ? x->s : x->exp, t, j, x->in);
+		k += j;
+		t += j;
+		m -= j;
+		if (k % x->nlayers != 0)
+			break;
+		if (n == x->npre) {
+			renormalize(x->s);
+			break;
+		}
+		v = delayed_view(x->exp, x->offset[n]);
+		accumulate_view_and_renormalize(x->pe, &v);
+		memset(x->exp->data, 0, sizeof(x->exp->data[0]) * x->exp->nsamples);
+		if (n == x->npre - 1)
+			x->preexplosions_done = stats_clock();
+	}
+}
+
+/* Resampler memory enough for any layer, the last being sped up most.
+ * Only input from a file is resampled, noise is made sped up already.
+ */
+static size_t layer_resampler_bytes(struct explosion_def *e)
+{
+	size_t a, b;
+	int f;
+
+	if (!e->input_data)
+		return 0;
+	f = e->nlayers > 1 ? 2 * (e->nlayers - 1) : 1;
+	a = resampler_bytes(seconds_to_frames(e->duration), f, e->resample_sinc);
+	b = resampler_bytes(seconds_to_frames(e->duration / 2), f, e->resample_sinc);
+	return a > b ? a : b;
+}
+
+/* Makes the main explosion, and in *pe the pre-explosions, if wanted,
+ * adding the time taken and samples made to *st.  Returns NULL if
+ * cancelled.
+ */
+static struct sound *make_explosions(struct explodomatica_context *ctx,
+		struct explosion_def *e, struct sound **pe,
+		struct explodomatica_stats *st)
+{
+	struct explosion_mix x;
+	struct layer_task *task;
+	struct layer_pool *pool = NULL;
+	struct layer_slot *slot;
+	struct sound **run;
+	struct arena_mark m;
+	char *finished;
+	int i, j, k, nsamples, nthreads, nslots, gave_up;
+	double start, done;
+
+	assert(e->nlayers > 0);
+	start = stats_clock();
+	memset(&x, 0, sizeof(x));
+	x.ctx = ctx;
+	x.e = e;
+	x.nlayers = e->nlayers;
+	x.npre = e->preexplosions > 0 ? e->preexplosions : 0;
+	x.ntasks = (x.npre + 1) * x.nlayers;
+
+	x.s = alloc_sound(ctx, seconds_to_frames(e->duration));
+	x.s->nsamples = seconds_to_frames(e->duration);
+	if (x.npre) {
+		x.pe = alloc_sound(ctx, seconds_to_frames(e->duration));
+		x.pe->nsamples = seconds_to_frames(e->duration);
+	}
+
+	m = arena_mark(ctx);
+	if (x.npre) {
+		x.exp = alloc_sound(ctx, seconds_to_frames(e->duration / 2));
+		x.exp->nsamples = seconds_to_frames(e->duration / 2);
+	}
+	task = arena_alloc(ctx, sizeof(*task) * x.ntasks);
+	finished = arena_alloc(ctx, x.ntasks);
+	x.offset = arena_alloc(ctx, sizeof(*x.offset) * (x.npre + 1));
+
+	/* Draw the seeds in the order the layers were once made in */
+	k = 0;
+	for (i = 0; i <= x.npre; i++) {
+		nsamples = seconds_to_frames(i < x.npre ? e->duration / 2 : e->duration);
+		for (j = 0; j < x.nlayers; j++, k++) {
+			task[k].seed = next_random(e);
+			task[k].layer = j;
+			task[k].nlayers = x.nlayers;
+			task[k].nsamples = nsamples;
+		}
+		if (i < x.npre)
+			x.offset[i] = irand(e, seconds_to_frames(e->preexplosion_delay));
+	}
+
+	nthreads = layer_threads(e, x.ntasks);
+	if (nthreads && !ctx->no_pool)
+		pool = context_pool(ctx, nthreads);
+	nslots = pool ? layer_slots(pool->nthreads) : 1;
+	if (nslots > x.ntasks)
+		nslots = x.ntasks;
+	slot = arena_alloc(ctx, sizeof(*slot) * nslots);
+	for (i = 0; i < nslots; i++) {
+		slot[i].t = alloc_sound(ctx, seconds_to_frames(e->duration));
+		slot[i].resampler_bytes = layer_resampler_bytes(e);
+		slot[i].resampler = arena_alloc(ctx, slot[i].resampler_bytes);
+	}
+	run = arena_alloc(ctx, sizeof(*run) * nslots);
+	x.in = arena_alloc(ctx, sizeof(*x.in) * nslots);
+
+	gave_up = make_layers(pool, e, task, x.ntasks, finished,
+				slot, nslots, run, mix_explosion_layers, &x);
+	arena_release(ctx, m);
+	done = stats_clock();
+	st->samples += x.samples;
+	if (x.npre && x.preexplosions_done > 0.0) {
+		st->preexplosion_seconds += x.preexplosions_done - start;
+		st->explosion_seconds += done - x.preexplosions_done;
+	} else {
+		st->explosion_seconds += done - start;
+	}
+	if (gave_up)
+		return NULL;
+
+	if (x.pe) {
+		if (e->preexplosion_lp_iters > 0)
+			sliding_low_pass(x.pe, e->lowpass_biquad,
+				e->preexplosion_lp_iters,
+				e->preexplosion_low_pass_factor,
+				e->preexplosion_low_pass_factor, e);
+		if (cancelled(e))
+			return NULL;
+		renormalize(x.pe);
+		st->preexplosion_seconds += stats_clock() - done;
+	}
+	*pe = x.pe;
+	return x.s;
+}
+
+/* What make_explosions() allocates, in bytes */
+static size_t make_explosions_bytes(struct explosion_def *e)
+{
+	size_t bytes;
+	int npre, ntasks, nslots;
+
+	npre = e->preexplosions > 0 ? e->preexplosions : 0;
+	ntasks = (npre + 1) * e->nlayers;
+	nslots = layer_slots(layer_threads(e, ntasks));
+	if (nslots > ntasks)
+		nslots = ntasks;
+	bytes = (sound_bytes(seconds_to_frames(e->duration)) +
+		arena_bytes(layer_resampler_bytes(e))) * nslots +
+		sound_bytes(seconds_to_frames(e->duration));
+	if (npre)
+		bytes += sound_bytes(seconds_to_frames(e->duration)) +
+			sound_bytes(seconds_to_frames(e->duration / 2));
+	bytes += arena_bytes(sizeof(struct layer_task) * ntasks) +
+		arena_bytes(ntasks) + arena_bytes(sizeof(int) * (npre + 1)) +
+		arena_bytes(sizeof(struct layer_slot) * nslots) +
+		2 * arena_bytes(sizeof(struct sound *) * nslots);
+	return bytes;
+}
+
+/* Reads filename into *input_data.  An impulse response (ir set) must be
+ * at SAMPLERATE, and is mixed down to mono if it has more channels, as
+ * convolution_reverb() wants.  Returns 0, or -1 if the file can't be used.
+ */
+static int read_input_file(char *filename, int ir,
+	sample_t **input_data, unsigned long long *input_samples)
+{
+	SF_INFO sfi;
+	SNDFILE *sf;
+	unsigned long long nframes;
+	unsigned long long buffersize;
+	unsigned long long samples;
+	unsigned long long i;
+	sample_t *d;
+	double sum;
+	int c;
+
+	memset(&sfi, 0, sizeof(sfi));
+
+	sf = sf_open(filename, SFM_READ, &sfi);
+	if (!sf) {
+		fprintf(stderr, "explodomatica: Cannot open '%s' for reading: %s\n", 
+			filename, sf_strerror(sf));
+		return -1;
+	}
+
+	printf("Input file:%s\n", filename);
+	printf("  frames:      %lu\n", sfi.frames);
+	printf("  sample rate: %d\n", sfi.samplerate);
+	printf("  channels:    %d\n", sfi.channels);
+	printf("    format:    %d\n", sfi.format);
+	printf("  sections:    %d\n", sfi.sections);
+	printf("  seekable:    %d\n", sfi.seekable);
+
+	if (ir && sfi.samplerate != SAMPLERATE) {
+		fprintf(stderr, "explodomatica: impulse response '%s' is %d Hz, "
+			"it must be %d Hz\n", filename, sfi.samplerate, SAMPLERATE);
+		sf_close(sf);
+		return -1;
+	}
+
+	samples = sfi.channels * sfi.frames;
+	buffersize = (sizeof(*input_data[0]) * samples);
+	d = malloc(buffersize);
+	if (!d)
+		out_of_memory(buffersize);
+	memset(d, 0, buffersize); 
+
+	printf("samples = %llu\n", samples);
+	nframes = sf_read_samples(sf, d, samples); 
+	if (nframes != samples) {
+		fprintf(stderr, "explodomatica: Error reading '%s': %s\n", 
 			filename, sf_strerror(sf));
-		exit(1);
+		free(d);
+		sf_close(sf);
+		return -1;
+	}
+	sf_close(sf);	
+
+	if (ir && sfi.channels > 1) {
+		printf("Mixing %d channel impulse response down to mono\n",
+			sfi.channels);
+		for (i = 0; i < (unsigned long long) sfi.frames; i++) {
+			sum = 0.0;
+			for (c = 0; c < sfi.channels; c++)
+				sum += d[i * sfi.channels + c];
+			d[i] = sum / sfi.channels;
+		}
+		nframes = sfi.frames;
+	}
+	*input_data = d;
+	*input_samples = nframes;
+	return 0;
+}
+
+int explodomatica_load_input(struct explosion_def *e)
+{
+	if (strcmp(e->input_file, "") != 0 && !e->input_data)
+		if (read_input_file(e->input_file, 0, &e->input_data, &e->input_samples) != 0)
+			return -1;
+	if (strcmp(e->reverb_ir_file, "") != 0 && !e->ir_data)
+		if (read_input_file(e->reverb_ir_file, 1, &e->ir_data, &e->ir_samples) != 0)
+			return -1;
+	return 0;
+}
+
+/* Render cache.  When e->cache_dir is set and the explosion has a seed,
+ * finished explosions are stored in cache_dir, named by a hash of
+ * everything which affects the output, and later requests for the same
+ * explosion just read the file back.  Samples are stored at full
+ * precision so a cache hit returns exactly what rendering would have.
+ *
+ * Bump CACHE_VERSION whenever a change alters the generated audio.
+ */
+#define CACHE_VERSION 8
+
+static pthread_mutex_t cache_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long cache_hits = 0;
+static unsigned long cache_misses = 0;
+static unsigned long cache_tmp_serial = 0;
+
+static unsigned long long hash_bytes(unsigned long long h, const void *p, size_t n)
+{
+	const unsigned char *c = p;
+	size_t i;
+
+	/* 64 bit FNV-1a */
+	for (i = 0; i < n; i++) {
+		h ^= c[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+#define HASH_FIELD(h, x) hash_bytes((h), &(x), sizeof(x))
+
+static unsigned long long explosion_hash(struct explosion_def *e)
+{
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	int version = CACHE_VERSION;
+	int sample_size = sizeof(sample_t);
+
+	h = HASH_FIELD(h, version);
+	h = HASH_FIELD(h, sample_size);
+	h = HASH_FIELD(h, e->seed);
+	h = HASH_FIELD(h, e->duration);
+	h = HASH_FIELD(h, e->nlayers);
+	h = HASH_FIELD(h, e->preexplosions);
+	h = HASH_FIELD(h, e->preexplosion_delay);
+	h = HASH_FIELD(h, e->preexplosion_low_pass_factor);
+	h = HASH_FIELD(h, e->preexplosion_lp_iters);
+	h = HASH_FIELD(h, e->final_speed_factor);
+	h = HASH_FIELD(h, e->reverb_early_refls);
+	h = HASH_FIELD(h, e->reverb_late_refls);
+	h = HASH_FIELD(h, e->reverb);
+	h = HASH_FIELD(h, e->reverb_compat);
+	h = HASH_FIELD(h, e->lowpass_biquad);
+	h = HASH_FIELD(h, e->resample_sinc);
+	h = HASH_FIELD(h, e->input_samples);
+	if (e->input_data)
+		h = hash_bytes(h, e->input_data,
+				sizeof(e->input_data[0]) * e->input_samples);
+	h = HASH_FIELD(h, e->ir_samples);
+	if (e->ir_data)
+		h = hash_bytes(h, e->ir_data, sizeof(e->ir_data[0]) * e->ir_samples);
+	return h;
+}
+
+static void cache_filename(struct explosion_def *e, char *filename, int len)
+{
+	snprintf(filename, len, "%s/%016llx.wav", e->cache_dir, explosion_hash(e));
+}
+
+static void count_cache_lookup(int hit)
+{
+	pthread_mutex_lock(&cache_stats_lock);
+	if (hit)
+		cache_hits++;
+	else
+		cache_misses++;
+	pthread_mutex_unlock(&cache_stats_lock);
+}
+
+static struct sound *cache_lookup(struct explodomatica_context *ctx,
+		struct explosion_def *e)
+{
+	char filename[PATH_MAX + 32];
+	SF_INFO sfi;
+	SNDFILE *sf;
+	struct sound *s;
+	struct arena_mark m;
+
+	cache_filename(e, filename, sizeof(filename));
+	memset(&sfi, 0, sizeof(sfi));
+	sf = sf_open(filename, SFM_READ, &sfi);
+	if (!sf) {
+		count_cache_lookup(0);
+		return NULL;
+	}
+	if (sfi.channels != 1 || sfi.frames <= 0 || sfi.frames > INT_MAX) {
+		sf_close(sf);
+		count_cache_lookup(0);
+		return NULL;
+	}
+	m = arena_mark(ctx);
+	s = alloc_sound(ctx, (int) sfi.frames);
+	s->nsamples = (int) sf_read_samples(sf, s->data, sfi.frames);
+	sf_close(sf);
+	if (s->nsamples != (int) sfi.frames) {
+		arena_release(ctx, m);
+		count_cache_lookup(0);
+		return NULL;
+	}
+	count_cache_lookup(1);
+	return s;
+}
+
+static void cache_store(struct explosion_def *e, struct sound *s)
+{
+	char filename[PATH_MAX + 32], tmpname[PATH_MAX + 64];
+	unsigned long serial;
+
+	cache_filename(e, filename, sizeof(filename));
+
+	/* Write to a private temporary file and rename it into place so
+	 * nobody ever sees a partly written cache entry.
+	 */
+	pthread_mutex_lock(&cache_stats_lock);
+	serial = cache_tmp_serial++;
+	pthread_mutex_unlock(&cache_stats_lock);
+	snprintf(tmpname, sizeof(tmpname), "%s.%d.%lu.tmp", filename,
+			(int) getpid(), serial);
+	if (save_sound(tmpname, s, 1, SF_FORMAT_WAV | SF_FORMAT_SAMPLES) != 0)
+		return;
+	if (rename(tmpname, filename) != 0) {
+		fprintf(stderr, "explodomatica: Cannot rename '%s' to '%s': %s\n",
+			tmpname, filename, strerror(errno));
+		unlink(tmpname);
+	}
+}
+
+void explodomatica_cache_stats(unsigned long *hits, unsigned long *misses)
+{
+	pthread_mutex_lock(&cache_stats_lock);
+	*hits = cache_hits;
+	*misses = cache_misses;
+	pthread_mutex_unlock(&cache_stats_lock);
+}
+
+/* Streaming renderer.
+ *
+ * With e->stream set, explodomatica() never holds a whole sound in
+ * memory.  Every stage -- noise, speeding up, fading out, the sliding
+ * low pass filters, mixing, the final change of speed and the reverb --
+ * is a small state machine producing a sample at a time, and the output
+ * is written to the file a block at a time as it is made, so memory use
+ * does not depend on the duration.
+ *
+ * The catch is renormalize(), which needs the peak of the whole sound
+ * before it can scale the first sample.  Each place the in memory code
+ * renormalizes gets a struct stream_gain, and the explosion is rendered
+ * several times over.  Each pass measures the peaks at those points
+ * whose inputs are by then completely known, and the last pass writes
+ * the file.  Since renormalize(k * x) is the same as renormalize(x), a
+ * point fed by a single chain of linear stages need not wait for the
+ * gains further up that chain, which keeps the number of passes down
+ * (three, plus the one which writes the file, by default.)
+ *
+ * The result is the same explosion as the in memory renderer makes,
+ * to within rounding, except that silence is trimmed only from the
+ * very end of the output rather than before and after the reverb.
+ */
+#define STREAM_BLOCK CONV_BLOCK	/* and the convolution reverb's block */
+
+struct stream_gain {
+	double peak;		/* measured this pass */
+	double divisor;		/* as renormalize_peak() would divide by */
+	int known;		/* divisor is valid */
+	int measure;		/* measure the peak this pass */
+};
+
+static void stream_gain_measure(struct stream_gain *g, sample_t x)
+{
+	if (g->measure && fabs(x) > g->peak)
+		g->peak = fabs(x);
+}
+
+/* Until the divisor is known, the sound is passed through unscaled */
+static sample_t stream_gain_apply(struct stream_gain *g, sample_t x)
+{
+	return g->known ? x / (sample_t) g->divisor : x;
+}
+
+/* One layer of make_explosion() */
+struct stream_layer {
+	struct explosion_def *e;
+	unsigned long long seed;	/* the noise kernel's key */
+	int nnoise, noise_pos;
+	int speedup;		/* change_speed() factor, 0 for the first layer */
+	struct resampler rs;	/* for input from a file */
+	struct speed_noise sn;	/* otherwise */
+	int len, pos;
+	int fades, lp_iters;
+	double a1, a2;
+	struct lowpass lp;
+	struct stream_gain g;
+};
+
+static sample_t stream_noise(void *arg)
+{
+	struct stream_layer *l = arg;
+	struct explosion_def *e = l->e;
+	int i = l->noise_pos++;
+
+	if (e->input_data)
+		return (unsigned long long) i < e->input_samples ? e->input_data[i] : 0.0;
+	return sample_noise(l->seed, (unsigned int) i, 1, NOISE_GAIN);
+}
+
+static void stream_layer_rewind(struct stream_layer *l)
+{
+	l->noise_pos = 0;
+	l->pos = 0;
+	if (l->speedup && l->e->input_data) {
+		resampler_start(&l->rs, NULL, stream_noise, l);
+		l->len = resampler_length(&l->rs);
+	} else if (l->speedup) {
+		speed_noise_init(&l->sn, l->seed, l->nnoise, l->speedup,
+				l->e->resample_sinc);
+		l->len = speed_noise_length(&l->sn);
+	} else {
+		l->len = l->nnoise;
+	}
+	if (l->len < 2)
+		l->len = 0;	/* see layer_length() */
+	lowpass_init(&l->lp, l->e->lowpass_biquad, l->lp_iters, l->a1, l->a2, l->len);
+}
+
+static sample_t stream_layer_next(struct stream_layer *l)
+{
+	int j = l->pos++, k;
+	sample_t x, f;
+
+	if (!l->speedup)
+		x = stream_noise(l);
+	else if (l->e->input_data)
+		x = resampler_next(&l->rs);
+	else
+		x = speed_noise_next(&l->sn);
+
+	f = (sample_t) 1.0 - ((sample_t) j / (sample_t) l->len);
+	for (k = 0; k < l->fades; k++)
+		x *= f;
+
+	if (!l->lp_iters)
+		return x;
+	x = lowpass_next(&l->lp, x);
+	stream_gain_measure(&l->g, x);
+	return stream_gain_apply(&l->g, x);
+}
+
+/* make_explosion(), before its final renormalize() */
+struct stream_explosion {
+	int nlayers;
+	int active;		/* layers not yet finished */
+	struct stream_layer *layer;
+	int len, pos;
+	int offset;		/* pre-explosions are delayed by this much */
+	struct stream_gain g;
+};
+
+static void stream_explosion_init(struct explodomatica_context *ctx,
+		struct explosion_def *e, struct stream_explosion *x,
+		double seconds, int nlayers)
+{
+	struct stream_layer *l;
+	int i;
+
+	assert(nlayers > 0);
+	x->nlayers = nlayers;
+	x->layer = arena_alloc(ctx, sizeof(*x->layer) * nlayers);
+	memset(x->layer, 0, sizeof(*x->layer) * nlayers);
+	x->offset = 0;
+	memset(&x->g, 0, sizeof(x->g));
+	for (i = 0; i < nlayers; i++) {
+		l = &x->layer[i];
+		l->e = e;
+		l->nnoise = seconds_to_frames(seconds);
+		l->speedup = i * 2;
+		l->fades = i + 1 > 3 ? 3 : i + 1;
+		l->a1 = (double) (i + 1) / (double) nlayers;
+		l->a2 = (double) i / (double) nlayers;
+		l->lp_iters = 3 - i < 0 ? 1 : 3 - i;
+		if (l->speedup && e->input_data)
+			resampler_init(&l->rs, l->nnoise, l->speedup, e->resample_sinc,
+				arena_alloc(ctx, resampler_bytes(l->nnoise,
+						l->speedup, e->resample_sinc)));
+		/* an unfiltered layer is not renormalized either */
+		l->g.known = !l->lp_iters;
+		l->g.divisor = 1.0;
+	}
+}
+
+static void stream_explosion_rewind(struct stream_explosion *x)
+{
+	int i;
+
+	for (i = 0; i < x->nlayers; i++) {
+		stream_layer_rewind(&x->layer[i]);
+		/* stream_explosion_next() counts on this */
+		assert(i == 0 || x->layer[i].len <= x->layer[i - 1].len);
+	}
+	x->len = x->layer[0].len;
+	x->active = x->nlayers;
+	x->pos = 0;
+}
+
+static int stream_layers_known(struct stream_explosion *x)
+{
+	int i;
+
+	for (i = 0; i < x->nlayers; i++)
+		if (!x->layer[i].g.known)
+			return 0;
+	return 1;
+}
+
+static sample_t stream_explosion_next(struct stream_explosion *x)
+{
+	sample_t v;
+	int i;
+
+	v = stream_layer_next(&x->layer[0]);
+	/* Each layer is shorter than the one before, so with many
+	 * layers, most of them are soon finished with.
+	 */
+	while (x->active > 1 && x->pos >= x->layer[x->active - 1].len)
+		x->active--;
+	for (i = 1; i < x->active; i++)
+		v = v + stream_layer_next(&x->layer[i]);
+	x->pos++;
+	stream_gain_measure(&x->g, v);
+	return v;
+}
+
+/* Sample j of the explosion's delayed_view(), which keeps the length
+ * the same, dropping whatever is pushed off the end.
+ */
+static sample_t stream_explosion_delayed(struct stream_explosion *x, int j)
+{
+	int source = j - x->offset;
+
+	if (j >= x->len || source <= 0)
+		return 0.0;
+	while (x->pos < source)
+		(void) stream_explosion_next(x);
+	return stream_explosion_next(x);
+}
+
+/* make_preexplosions().  g[k] is the renormalization after the k'th
+ * pre-explosion is mixed in, lp_gain the one after the low pass filters.
+ */
+struct stream_preexplosions {
+	int n;
+	struct stream_explosion *x;
+	struct stream_gain *g;
+	int pos;
+	int lp_iters;
+	int nlp;		/* LOWPASS_MAX_STAGES stages apiece */
+	struct lowpass *lp;
+	struct stream_gain lp_gain;
+};
+
+static sample_t stream_preexplosions_next(struct stream_preexplosions *p)
+{
+	int j = p->pos++, k;
+	sample_t v;
+
+	/* renormalizing the first pre-explosion on its own is the same as
+	 * renormalizing it as part of its explosion, so use it raw.
+	 */
+	v = stream_explosion_delayed(&p->x[0], j);
+	stream_gain_measure(&p->g[0], v);
+	for (k = 1; k < p->n; k++) {
+		v = stream_gain_apply(&p->g[k - 1], v) +
+			stream_gain_apply(&p->x[k].g, stream_explosion_delayed(&p->x[k], j));
+		stream_gain_measure(&p->g[k], v);
 	}
+	/* likewise the low pass filters may as well run before the last
+	 * renormalization, since another one follows them.
+	 */
+	for (k = 0; k < p->nlp; k++)
+		v = lowpass_next(&p->lp[k], v);
+	stream_gain_measure(&p->lp_gain, v);
+	return v;
+}
 
-	printf("Input file:%s\n", filename);
-	printf("  frames:      %lu\n", sfi.frames);
-	printf("  sample rate: %d\n", sfi.samplerate);
-	printf("  channels:    %d\n", sfi.channels);
-	printf("    format:    %d\n", sfi.format);
-	printf("  sections:    %d\n", sfi.sections);
-	printf("  seekable:    %d\n", sfi.seekable);
+struct stream_render {
+	struct explodomatica_context *ctx;
+	struct explosion_def *e;
+	struct stream_explosion main;
+	struct stream_preexplosions pre;
+	struct stream_gain mix_gain;	/* main explosion plus pre-explosions */
+	struct stream_gain *s_gain;	/* the one applied to the dry sound */
+	struct stream_gain conv_gain;
+	int conv;
+	int len, pos;
+	struct resampler rs;		/* final speed change */
+	int ngains;
+	struct stream_gain **gains;	/* all of the above */
+};
+
+/* The dry sound, before the final renormalization */
+static sample_t stream_dry_raw(void *arg)
+{
+	struct stream_render *r = arg;
+	sample_t v;
+
+	r->pos++;
+	v = stream_explosion_next(&r->main);
+	if (!r->pre.n)
+		return v;
+	v = stream_gain_apply(&r->main.g, v) +
+		stream_gain_apply(&r->pre.lp_gain, stream_preexplosions_next(&r->pre));
+	stream_gain_measure(&r->mix_gain, v);
+	return v;
+}
 
-	samples = sfi.channels * sfi.frames;
-	buffersize = (sizeof(*input_data[0]) * samples);
-	*input_data = malloc(buffersize);
-	memset(*input_data, 0, buffersize); 
+static sample_t stream_dry(void *arg)
+{
+	struct stream_render *r = arg;
 
-	printf("samples = %llu\n", samples);
-	nframes = sf_read_double(sf, *input_data, samples); 
-	if (nframes != samples) {
-		fprintf(stderr, "explodomatica: Error reading '%s': %s\n", 
-			filename, sf_strerror(sf));
-		exit(1);
+	return stream_gain_apply(r->s_gain, stream_dry_raw(r));
+}
+
+static void stream_add_gain(struct stream_render *r, struct stream_gain *g)
+{
+	r->gains[r->ngains++] = g;
+}
+
+/* Draws the seeds of every layer, and the pre-explosions' delays, from
+ * e's generator, in the same order make_explosions() does.
+ */
+static void stream_render_seed(struct stream_render *r)
+{
+	struct explosion_def *e = r->e;
+	int i, j;
+
+	for (i = 0; i < r->pre.n; i++) {
+		for (j = 0; j < r->pre.x[i].nlayers; j++)
+			r->pre.x[i].layer[j].seed = next_random(e);
+		r->pre.x[i].offset = irand(e, seconds_to_frames(e->preexplosion_delay));
 	}
-	*input_samples = nframes;
+	for (j = 0; j < r->main.nlayers; j++)
+		r->main.layer[j].seed = next_random(e);
+}
 
-	sf_close(sf);	
+static void stream_render_init(struct explodomatica_context *ctx,
+		struct explosion_def *e, struct stream_render *r)
+{
+	struct stream_preexplosions *p = &r->pre;
+	int i, j;
+
+	memset(r, 0, sizeof(*r));
+	r->ctx = ctx;
+	r->e = e;
+	r->conv = e->reverb && e->ir_data && e->ir_samples > 0;
+
+	p->n = e->preexplosions > 0 ? e->preexplosions : 0;
+	p->x = arena_alloc(ctx, sizeof(*p->x) * (p->n + 1));
+	p->g = arena_alloc(ctx, sizeof(*p->g) * (p->n + 1));
+	memset(p->g, 0, sizeof(*p->g) * (p->n + 1));
+	for (i = 0; i < p->n; i++)
+		stream_explosion_init(ctx, e, &p->x[i], e->duration / 2, e->nlayers);
+	p->lp_iters = e->preexplosion_lp_iters > 0 ? e->preexplosion_lp_iters : 0;
+	p->nlp = (p->lp_iters + LOWPASS_MAX_STAGES - 1) / LOWPASS_MAX_STAGES;
+	p->lp = arena_alloc(ctx, sizeof(*p->lp) * (p->nlp + 1));
+	memset(&p->lp_gain, 0, sizeof(p->lp_gain));
+	stream_explosion_init(ctx, e, &r->main, e->duration, e->nlayers);
+	r->s_gain = p->n ? &r->mix_gain : &r->main.g;
+	stream_render_seed(r);
+
+	r->gains = arena_alloc(ctx, sizeof(*r->gains) *
+			((p->n + 1) * (e->nlayers + 2) + 2));
+	for (i = 0; i < p->n; i++) {
+		for (j = 0; j < e->nlayers; j++)
+			stream_add_gain(r, &p->x[i].layer[j].g);
+		stream_add_gain(r, &p->x[i].g);
+		stream_add_gain(r, &p->g[i]);
+	}
+	stream_add_gain(r, &p->lp_gain);
+	for (j = 0; j < e->nlayers; j++)
+		stream_add_gain(r, &r->main.layer[j].g);
+	stream_add_gain(r, &r->main.g);
+	stream_add_gain(r, &r->mix_gain);
+	stream_add_gain(r, &r->conv_gain);
 }
 
-struct sound *explodomatica(struct explosion_def *e)
+static void stream_render_rewind(struct stream_render *r)
+{
+	int i, k;
+
+	for (i = 0; i < r->pre.n; i++)
+		stream_explosion_rewind(&r->pre.x[i]);
+	for (i = 0; i < r->pre.nlp; i++) {
+		k = r->pre.lp_iters - i * LOWPASS_MAX_STAGES;
+		lowpass_init(&r->pre.lp[i], r->e->lowpass_biquad,
+			k < LOWPASS_MAX_STAGES ? k : LOWPASS_MAX_STAGES,
+			r->e->preexplosion_low_pass_factor,
+			r->e->preexplosion_low_pass_factor, 0);
+	}
+	r->pre.pos = 0;
+	stream_explosion_rewind(&r->main);
+	r->len = r->main.len;
+	r->pos = 0;
+}
+
+/* Decide which peaks can be measured in the next pass.  A peak can be
+ * measured once every gain applied to the sound it is the peak of is
+ * known.  Returns the number of peaks to measure.
+ */
+static int stream_plan_pass(struct stream_render *r)
+{
+	struct stream_preexplosions *p = &r->pre;
+	int i, j, n, dry_ready;
+
+	for (i = 0; i < p->n; i++) {
+		for (j = 0; j < p->x[i].nlayers; j++)
+			p->x[i].layer[j].g.measure = 1;
+		p->x[i].g.measure = stream_layers_known(&p->x[i]);
+		if (i == 0)
+			p->g[i].measure = stream_layers_known(&p->x[0]);
+		else
+			p->g[i].measure = p->g[i - 1].known && p->x[i].g.known;
+	}
+	if (p->n == 1)
+		p->lp_gain.measure = stream_layers_known(&p->x[0]);
+	else if (p->n > 1)
+		p->lp_gain.measure = p->g[p->n - 2].known && p->x[p->n - 1].g.known;
+	for (j = 0; j < r->main.nlayers; j++)
+		r->main.layer[j].g.measure = 1;
+	r->main.g.measure = stream_layers_known(&r->main);
+	if (p->n) {
+		dry_ready = r->main.g.known && p->lp_gain.known;
+		r->mix_gain.measure = dry_ready;
+	} else {
+		dry_ready = stream_layers_known(&r->main);
+	}
+	r->conv_gain.measure = r->conv && dry_ready;
+
+	n = 0;
+	for (i = 0; i < r->ngains; i++) {
+		r->gains[i]->measure = r->gains[i]->measure && !r->gains[i]->known;
+		r->gains[i]->peak = 0.0;
+		n += r->gains[i]->measure;
+	}
+	return n;
+}
+
+static void stream_finish_pass(struct stream_render *r)
+{
+	struct stream_gain *g;
+	int i;
+
+	for (i = 0; i < r->ngains; i++) {
+		g = r->gains[i];
+		if (!g->measure)
+			continue;
+		g->divisor = g->peak > 0.0 ? 1.05 * g->peak : 1.0;
+		g->known = 1;
+		g->measure = 0;
+	}
+}
+
+/* Everything needed to write the output is known? */
+static int stream_ready(struct stream_render *r)
+{
+	return r->conv ? r->conv_gain.known : r->s_gain->known;
+}
+
+static int stream_count_passes(struct stream_render *r)
+{
+	int i, n, *known;
+	struct arena_mark m = arena_mark(r->ctx);
+
+	known = arena_alloc(r->ctx, sizeof(*known) * r->ngains);
+	for (i = 0; i < r->ngains; i++)
+		known[i] = r->gains[i]->known;
+	for (n = 1; !stream_ready(r); n++) {
+		if (!stream_plan_pass(r))
+			break;
+		for (i = 0; i < r->ngains; i++)
+			r->gains[i]->known |= r->gains[i]->measure;
+	}
+	for (i = 0; i < r->ngains; i++) {
+		r->gains[i]->known = known[i];
+		r->gains[i]->measure = 0;
+	}
+	arena_release(r->ctx, m);
+	return n;
+}
+
+/* Produces the next block of output, count samples long, returns how
+ * many of them are real output (the rest are zero.)
+ */
+struct stream_output {
+	struct stream_render *r;
+	int ndry, dry_pos;	/* length of the sped up dry sound */
+	int len, pos;		/* length of the output */
+	struct tap_reverb *verb;
+	struct conv_reverb *conv;
+	sample_t in[STREAM_BLOCK];
+};
+
+/* Back to the start of the output, with the same reverb */
+static void stream_output_rewind(struct stream_output *o)
+{
+	struct stream_render *r = o->r;
+
+	resampler_start(&r->rs, NULL, r->conv ? stream_dry_raw : stream_dry, r);
+	o->dry_pos = 0;
+	o->pos = 0;
+}
+
+/* With any_room set, the reverb can be given another room by
+ * tap_reverb_restart().  conv_block is the convolution reverb's block
+ * size, at most STREAM_BLOCK.
+ */
+static void stream_output_init(struct stream_output *o, struct stream_render *r,
+		int any_room, int conv_block)
+{
+	struct explosion_def *e = r->e;
+
+	o->r = r;
+	resampler_init(&r->rs, r->len, e->final_speed_factor, e->resample_sinc,
+			arena_alloc(r->ctx, resampler_bytes(r->len,
+					e->final_speed_factor, e->resample_sinc)));
+	o->ndry = resampler_length(&r->rs);
+	o->verb = NULL;
+	o->conv = NULL;
+	if (r->conv) {
+		o->len = o->ndry + (int) e->ir_samples - 1;
+		o->conv = arena_alloc(r->ctx, sizeof(*o->conv));
+		conv_reverb_init(r->ctx, e, o->conv, conv_block);
+	} else if (e->reverb) {
+		o->len = o->ndry * 2;
+		o->verb = arena_alloc(r->ctx, sizeof(*o->verb));
+		if (any_room)
+			tap_reverb_init_any(r->ctx, e, o->verb, o->len);
+		else
+			tap_reverb_init(r->ctx, e, o->verb, o->len);
+	} else {
+		o->len = o->ndry;
+	}
+	stream_output_rewind(o);
+}
+
+/* count is at most STREAM_BLOCK, and with the convolution reverb,
+ * exactly its block size.
+ */
+static int stream_output_block(struct stream_output *o, sample_t *out, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		o->in[i] = o->dry_pos++ < o->ndry ? resampler_next(&o->r->rs) : 0.0;
+	if (o->conv) {
+		conv_reverb_process(o->conv, o->in, out);
+		for (i = 0; i < count; i++) {
+			stream_gain_measure(&o->r->conv_gain, out[i]);
+			out[i] = stream_gain_apply(&o->r->conv_gain, out[i]);
+		}
+	} else if (o->verb) {
+		tap_reverb_process(o->verb, o->in, out, count);
+	} else {
+		memcpy(out, o->in, sizeof(o->in[0]) * count);
+	}
+	if (count > o->len - o->pos)
+		count = o->len - o->pos;
+	o->pos += count;
+	return count;
+}
+
+/* Runs whatever of the explosion is needed to measure the peaks planned
+ * for this pass, to the very end of every stage that has a peak measured.
+ */
+static int stream_analysis_pass(struct stream_render *r)
+{
+	struct explosion_def *e = r->e;
+	struct stream_explosion *x;
+	struct stream_output o;
+	struct arena_mark m;
+	sample_t out[STREAM_BLOCK];
+	int i, j;
+
+	stream_render_rewind(r);
+	if (r->conv_gain.measure) {
+		m = arena_mark(r->ctx);
+		stream_output_init(&o, r, 0, STREAM_BLOCK);
+		while (o.pos < o.len) {
+			stream_output_block(&o, out, STREAM_BLOCK);
+			if (stage_progress(r->ctx, e, (float) o.pos / (float) o.len))
+				break;
+		}
+		arena_release(r->ctx, m);
+	}
+	while (r->pos < r->len && !cancelled(e)) {
+		for (j = 0; j < STREAM_BLOCK && r->pos < r->len; j++)
+			(void) stream_dry_raw(r);
+		if (!r->conv_gain.measure)
+			stage_progress(r->ctx, e, (float) r->pos / (float) r->len);
+	}
+	for (i = 0; i < r->pre.n; i++) {
+		x = &r->pre.x[i];
+		while (x->pos < x->len && !cancelled(e))
+			for (j = 0; j < STREAM_BLOCK && x->pos < x->len; j++)
+				(void) stream_explosion_next(x);
+	}
+	dot(e);
+	return cancelled(e) ? -1 : 0;
+}
+
+static int stream_write_pass(struct stream_render *r)
+{
+	struct explosion_def *e = r->e;
+	struct stream_output o;
+	struct arena_mark m;
+	sample_t out[STREAM_BLOCK];
+	SNDFILE *sf;
+	SF_INFO sfinfo;
+	sf_count_t written, last;
+	int i, count;
+
+	memset(&sfinfo, 0, sizeof(sfinfo));
+	sfinfo.samplerate = SAMPLERATE;
+	sfinfo.channels = 1;
+	sfinfo.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
+	sf = sf_open(e->save_filename, SFM_WRITE, &sfinfo);
+	if (!sf) {
+		fprintf(stderr, "Cannot open '%s'\n", e->save_filename);
+		return -1;
+	}
+
+	stream_render_rewind(r);
+	m = arena_mark(r->ctx);
+	stream_output_init(&o, r, 0, STREAM_BLOCK);
+	written = 0;
+	last = -1;
+	while (o.pos < o.len) {
+		count = stream_output_block(&o, out, STREAM_BLOCK);
+		for (i = 0; i < count; i++)
+			if (fabs(out[i]) >= 0.00001)
+				last = written + i;
+		sf_write_samples(sf, out, count);
+		written += count;
+		if (stage_progress(r->ctx, e, (float) o.pos / (float) o.len))
+			break;
+	}
+	arena_release(r->ctx, m);
+	say(e, "done\n");
+
+	/* trim trailing silence */
+	last++;
+	if (last < written)
+		sf_command(sf, SFC_FILE_TRUNCATE, &last, sizeof(last));
+	sf_close(sf);
+	if (cancelled(e)) {
+		unlink(e->save_filename);
+		return -1;
+	}
+	say(e, "Saved output in '%s'\n", e->save_filename);
+	return (int) last;
+}
+
+static struct sound *stream_explodomatica(struct explodomatica_context *ctx,
+		struct explosion_def *e)
+{
+	struct stream_render r;
+	struct sound *s = NULL;
+	int pass, npasses, nsamples;
+
+	if (strcmp(e->save_filename, "") == 0) {
+		fprintf(stderr, "explodomatica: streaming needs an output file\n");
+		return NULL;
+	}
+	stream_render_init(ctx, e, &r);
+	npasses = stream_count_passes(&r);
+	say(e, "Rendering in %d passes", npasses);
+	for (pass = 1; pass < npasses; pass++) {
+		begin_stage(ctx, e, (float) (pass - 1) / (float) npasses,
+				(float) pass / (float) npasses);
+		stream_plan_pass(&r);
+		if (stream_analysis_pass(&r) != 0)
+			goto out;
+		stream_finish_pass(&r);
+	}
+	begin_stage(ctx, e, (float) (npasses - 1) / (float) npasses, 1.0);
+	nsamples = stream_write_pass(&r);
+	if (nsamples < 0)
+		goto out;
+	s = arena_alloc(ctx, sizeof(*s));
+	s->data = NULL;
+	s->nsamples = nsamples;
+out:
+	report_progress(e, s ? 1.0 : 0.0);
+	return s;
+}
+
+/* Realtime engine.  The explosion is made a block at a time as it plays,
+ * by the streaming renderer's stages.  What stops the streaming renderer
+ * making an explosion in a single pass is the renormalizations, so here
+ * their gains are measured once, for the explosion the engine is made
+ * for, and kept for every explosion it makes after that.  Other seeds
+ * peak a few percent either side of it, so the output is clipped at
+ * full scale.  Every stage does a fixed amount of work per sample, and
+ * once made, the engine allocates nothing.
+ */
+#define REALTIME_BLOCK 256	/* samples made at a time */
+
+struct explodomatica_realtime {
+	struct explodomatica_context *ctx;
+	struct explosion_def e;		/* a copy; its generator is reseeded */
+	sample_t *input_data, *ir_data;	/* if read by the engine itself */
+	struct stream_render r;
+	struct stream_output o;
+	int playing;
+	int nblock, blockpos;		/* samples in block[], and handed out */
+	sample_t block[REALTIME_BLOCK];
+};
+
+struct explodomatica_realtime *explodomatica_realtime_new(struct explosion_def *e)
+{
+	struct explodomatica_realtime *rt;
+	int rc, pass, npasses;
+
+	rt = malloc(sizeof(*rt));
+	if (!rt)
+		return NULL;
+	memset(rt, 0, sizeof(*rt));
+	rt->e = *e;
+	rt->e.progress = NULL;
+	rt->e.progress_fn = NULL;
+	rt->e.cancel = 0;
+	rt->e.context = NULL;
+	rt->e.stats = NULL;
+	rc = explodomatica_load_input(&rt->e);
+	if (rt->e.input_data != e->input_data)
+		rt->input_data = rt->e.input_data;
+	if (rt->e.ir_data != e->ir_data)
+		rt->ir_data = rt->e.ir_data;
+	if (rc != 0) {
+		explodomatica_realtime_free(rt);
+		return NULL;
+	}
+	explodomatica_seed(&rt->e, rt->e.seed >= 0 ?
+		(unsigned long long) rt->e.seed : (unsigned long long) rand());
+
+	rt->ctx = explodomatica_context_new();
+	arena_reset(rt->ctx, 0);
+	stream_render_init(rt->ctx, &rt->e, &rt->r);
+	npasses = stream_count_passes(&rt->r);
+	for (pass = 1; pass < npasses; pass++) {
+		stream_plan_pass(&rt->r);
+		stream_analysis_pass(&rt->r);
+		stream_finish_pass(&rt->r);
+	}
+	stream_output_init(&rt->o, &rt->r, 1, REALTIME_BLOCK);
+	return rt;
+}
+
+void explodomatica_realtime_free(struct explodomatica_realtime *rt)
+{
+	if (!rt)
+		return;
+	explodomatica_context_free(rt->ctx);
+	free(rt->input_data);
+	free(rt->ir_data);
+	free(rt);
+}
+
+void explodomatica_realtime_trigger(struct explodomatica_realtime *rt,
+		unsigned long long seed)
+{
+	explodomatica_seed(&rt->e, seed);
+	stream_render_seed(&rt->r);
+	stream_render_rewind(&rt->r);
+	stream_output_rewind(&rt->o);
+	if (rt->o.conv)
+		conv_reverb_restart(rt->o.conv);
+	if (rt->o.verb)
+		tap_reverb_restart(&rt->e, rt->o.verb);
+	rt->nblock = 0;
+	rt->blockpos = 0;
+	rt->playing = 1;
+}
+
+int explodomatica_realtime_render(struct explodomatica_realtime *rt,
+		float *out, int nframes)
+{
+	int i, n, made = 0;
+	sample_t x;
+
+	while (made < nframes) {
+		if (rt->blockpos == rt->nblock) {
+			if (!rt->playing || rt->o.pos >= rt->o.len) {
+				rt->playing = 0;
+				break;
+			}
+			rt->nblock = stream_output_block(&rt->o, rt->block, REALTIME_BLOCK);
+			rt->blockpos = 0;
+		}
+		n = rt->nblock - rt->blockpos;
+		if (n > nframes - made)
+			n = nframes - made;
+		for (i = 0; i < n; i++) {
+			x = rt->block[rt->blockpos + i];
+			if (x > 1.0)
+				x = 1.0;
+			if (x < -1.0)
+				x = -1.0;
+			out[made + i] = (float) x;
+		}
+		rt->blockpos += n;
+		made += n;
+	}
+	for (i = made; i < nframes; i++)
+		out[i] = 0.0f;
+	return made;
+}
+
+/* Variant banks.  The file is a struct bank_header, the bank's
+ * struct bank_entry index, then each variant's samples, starting on a
+ * BANK_ALIGN byte boundary so they are as well aligned in the mapping
+ * as malloc() would have them.  A variant's offset is 0 if it is empty.
+ * The samples go into the file as each variant is added, and the index
+ * is written over the space kept for it at the start when the bank is
+ * finished.  Last comes the string table, holding the names of the
+ * input and impulse response files the variants were made from, each
+ * once, NUL terminated.  It starts with an empty string, so a name at
+ * offset 0 is none.
+ *
+ * Bump BANK_VERSION whenever the layout changes.
+ */
+#define BANK_MAGIC "EXPLBANK"
+#define BANK_VERSION 2
+#define BANK_BYTE_ORDER 0x01020304
+#define BANK_ALIGN 64
+
+struct bank_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;	/* BANK_BYTE_ORDER, as the writer saw it */
+	uint32_t format;	/* EXPLODOMATICA_BANK_INT16 or _FLOAT */
+	uint32_t samplerate;
+	uint32_t nvariants;
+	uint32_t entry_size;	/* sizeof(struct bank_entry) */
+	uint64_t file_size;
+	uint64_t strings;	/* offset of the string table */
+	uint32_t strings_size;
+	char pad[12];
+};
+
+struct bank_entry {
+	uint64_t offset;
+	uint32_t nsamples;
+	uint32_t pad;
+	int64_t seed;
+	double duration;
+	double preexplosion_delay;
+	double preexplosion_low_pass_factor;
+	double final_speed_factor;
+	int32_t nlayers;
+	int32_t preexplosions;
+	int32_t preexplosion_lp_iters;
+	int32_t reverb_early_refls;
+	int32_t reverb_late_refls;
+	int32_t reverb;
+	int32_t reverb_compat;
+	int32_t lowpass_biquad;
+	int32_t resample_sinc;
+	uint32_t input_file;	/* in the string table */
+	uint32_t reverb_ir_file;
+	uint32_t pad2;
+};
+
+struct explodomatica_bank_writer {
+	char filename[PATH_MAX + 1];
+	char tmpname[PATH_MAX + 32];
+	FILE *f;
+	struct bank_header h;
+	struct bank_entry *entry;
+	char *strings;		/* the string table, written last */
+	uint32_t strings_size;
+	uint64_t end;		/* bytes written so far */
+	int failed;
+};
+
+struct explodomatica_bank {
+	void *map;
+	size_t size;
+	struct bank_header *h;
+	struct bank_entry *entry;
+};
+
+static size_t bank_sample_size(uint32_t format)
+{
+	return format == EXPLODOMATICA_BANK_INT16 ? sizeof(int16_t) : sizeof(float);
+}
+
+static uint64_t bank_data_start(uint32_t nvariants)
+{
+	uint64_t n = sizeof(struct bank_header) +
+			(uint64_t) nvariants * sizeof(struct bank_entry);
+
+	return (n + BANK_ALIGN - 1) & ~((uint64_t) BANK_ALIGN - 1);
+}
+
+/* Writes n zero bytes, or n bytes of p */
+static void bank_write(struct explodomatica_bank_writer *w, const void *p, size_t n)
+{
+	static const char zero[BANK_ALIGN] = { 0 };
+	size_t k;
+
+	if (w->failed)
+		return;
+	while (n > 0) {
+		k = p || n < sizeof(zero) ? n : sizeof(zero);
+		if (fwrite(p ? p : zero, 1, k, w->f) != k) {
+			fprintf(stderr, "explodomatica: Cannot write '%s': %s\n",
+				w->tmpname, strerror(errno));
+			w->failed = 1;
+			return;
+		}
+		w->end += k;
+		n -= k;
+		if (p)
+			p = (const char *) p + k;
+	}
+}
+
+struct explodomatica_bank_writer *explodomatica_bank_create(const char *filename,
+		int nvariants, int format)
+{
+	struct explodomatica_bank_writer *w;
+
+	if (nvariants <= 0 || (format != EXPLODOMATICA_BANK_INT16 &&
+			format != EXPLODOMATICA_BANK_FLOAT)) {
+		fprintf(stderr, "explodomatica: bad bank of %d variants, format %d\n",
+			nvariants, format);
+		return NULL;
+	}
+	w = malloc(sizeof(*w));
+	if (!w)
+		out_of_memory(sizeof(*w));
+	memset(w, 0, sizeof(*w));
+	strncpy(w->filename, filename, PATH_MAX);
+	snprintf(w->tmpname, sizeof(w->tmpname), "%s.%d.tmp", w->filename,
+			(int) getpid());
+	w->f = fopen(w->tmpname, "w");
+	if (!w->f) {
+		fprintf(stderr, "explodomatica: Cannot create '%s': %s\n",
+			w->tmpname, strerror(errno));
+		free(w);
+		return NULL;
+	}
+	memcpy(w->h.magic, BANK_MAGIC, sizeof(w->h.magic));
+	w->h.version = BANK_VERSION;
+	w->h.byte_order = BANK_BYTE_ORDER;
+	w->h.format = format;
+	w->h.samplerate = SAMPLERATE;
+	w->h.nvariants = nvariants;
+	w->h.entry_size = sizeof(struct bank_entry);
+	w->entry = malloc(sizeof(*w->entry) * nvariants);
+	if (!w->entry)
+		out_of_memory(sizeof(*w->entry) * nvariants);
+	memset(w->entry, 0, sizeof(*w->entry) * nvariants);
+	w->strings = malloc(1);
+	if (!w->strings)
+		out_of_memory(1);
+	w->strings[0] = '\0';
+	w->strings_size = 1;
+
+	/* room for the header and index, filled in by explodomatica_bank_finish() */
+	bank_write(w, NULL, bank_data_start(nvariants));
+	return w;
+}
+
+/* Where str is in the string table, putting it there if it isn't yet */
+static uint32_t bank_string(struct explodomatica_bank_writer *w, const char *str)
+{
+	uint32_t i, n = strlen(str) + 1;
+
+	for (i = 0; i < w->strings_size; i += strlen(&w->strings[i]) + 1)
+		if (strcmp(&w->strings[i], str) == 0)
+			return i;
+	w->strings = realloc(w->strings, w->strings_size + n);
+	if (!w->strings)
+		out_of_memory(w->strings_size + n);
+	memcpy(&w->strings[w->strings_size], str, n);
+	w->strings_size += n;
+	return i;
+}
+
+int explodomatica_bank_add(struct explodomatica_bank_writer *w, int variant,
+		struct explosion_def *e, struct sound *s)
+{
+	struct bank_entry *b;
+	int16_t i16[4096];
+	float f[4096];
+	double x;
+	int i, j, n;
+
+	if (variant < 0 || variant >= (int) w->h.nvariants || w->entry[variant].offset)
+		return -1;
+	b = &w->entry[variant];
+	b->seed = e->seed;
+	b->duration = e->duration;
+	b->preexplosion_delay = e->preexplosion_delay;
+	b->preexplosion_low_pass_factor = e->preexplosion_low_pass_factor;
+	b->final_speed_factor = e->final_speed_factor;
+	b->nlayers = e->nlayers;
+	b->preexplosions = e->preexplosions;
+	b->preexplosion_lp_iters = e->preexplosion_lp_iters;
+	b->reverb_early_refls = e->reverb_early_refls;
+	b->reverb_late_refls = e->reverb_late_refls;
+	b->reverb = e->reverb;
+	b->reverb_compat = e->reverb_compat;
+	b->lowpass_biquad = e->lowpass_biquad;
+	b->resample_sinc = e->resample_sinc;
+	b->input_file = bank_string(w, e->input_file);
+	b->reverb_ir_file = bank_string(w, e->reverb_ir_file);
+	if (!s || s->nsamples <= 0)
+		return 0;
+
+	bank_write(w, NULL, (BANK_ALIGN - w->end % BANK_ALIGN) % BANK_ALIGN);
+	b->offset = w->end;
+	b->nsamples = s->nsamples;
+	for (i = 0; i < s->nsamples; i += n) {
+		n = s->nsamples - i;
+		if (n > (int) ARRAYSIZE(f))
+			n = ARRAYSIZE(f);
+		if (w->h.format == EXPLODOMATICA_BANK_FLOAT) {
+			for (j = 0; j < n; j++)
+				f[j] = (float) s->data[i + j];
+			bank_write(w, f, sizeof(f[0]) * n);
+			continue;
+		}
+		for (j = 0; j < n; j++) {
+			x = s->data[i + j];
+			if (x > 1.0)
+				x = 1.0;
+			if (x < -1.0)
+				x = -1.0;
+			i16[j] = (int16_t) lrint(x * 32767.0);
+		}
+		bank_write(w, i16, sizeof(i16[0]) * n);
+	}
+	return w->failed ? -1 : 0;
+}
+
+int explodomatica_bank_finish(struct explodomatica_bank_writer *w)
+{
+	int rc = -1;
+
+	w->h.strings = w->end;
+	w->h.strings_size = w->strings_size;
+	bank_write(w, w->strings, w->strings_size);
+	w->h.file_size = w->end;
+	if (!w->failed && fseek(w->f, 0, SEEK_SET) != 0) {
+		fprintf(stderr, "explodomatica: Cannot seek in '%s': %s\n",
+			w->tmpname, strerror(errno));
+		w->failed = 1;
+	}
+	bank_write(w, &w->h, sizeof(w->h));
+	bank_write(w, w->entry, sizeof(*w->entry) * w->h.nvariants);
+	if (fclose(w->f) != 0 && !w->failed) {
+		fprintf(stderr, "explodomatica: Cannot write '%s': %s\n",
+			w->tmpname, strerror(errno));
+		w->failed = 1;
+	}
+	if (w->failed)
+		unlink(w->tmpname);
+	else if (rename(w->tmpname, w->filename) != 0) {
+		fprintf(stderr, "explodomatica: Cannot rename '%s' to '%s': %s\n",
+			w->tmpname, w->filename, strerror(errno));
+		unlink(w->tmpname);
+	} else {
+		printf("Saved bank in '%s'\n", w->filename);
+		rc = 0;
+	}
+	free(w->strings);
+	free(w->entry);
+	free(w);
+	return rc;
+}
+
+static int bank_valid(struct explodomatica_bank *b)
+{
+	struct bank_header *h = b->h;
+	uint64_t n;
+	uint32_t i;
+
+	if (b->size < sizeof(*h) ||
+		memcmp(h->magic, BANK_MAGIC, sizeof(h->magic)) != 0 ||
+		h->version != BANK_VERSION || h->byte_order != BANK_BYTE_ORDER ||
+		h->entry_size != sizeof(struct bank_entry) ||
+		h->samplerate != SAMPLERATE || h->file_size != b->size ||
+		(h->format != EXPLODOMATICA_BANK_INT16 &&
+			h->format != EXPLODOMATICA_BANK_FLOAT) ||
+		bank_data_start(h->nvariants) > b->size ||
+		h->strings < bank_data_start(h->nvariants) || h->strings > b->size ||
+		h->strings_size < 1 || h->strings_size > b->size - h->strings ||
+		((const char *) b->map)[h->strings + h->strings_size - 1] != '\0')
+		return 0;
+	for (i = 0; i < h->nvariants; i++) {
+		if (b->entry[i].input_file >= h->strings_size ||
+			b->entry[i].reverb_ir_file >= h->strings_size)
+			return 0;
+		if (!b->entry[i].offset)
+			continue;
+		n = (uint64_t) b->entry[i].nsamples * bank_sample_size(h->format);
+		if (b->entry[i].offset % BANK_ALIGN ||
+			b->entry[i].offset < bank_data_start(h->nvariants) ||
+			b->entry[i].offset > b->size ||
+			n > b->size - b->entry[i].offset ||
+			b->entry[i].nsamples > INT_MAX)
+			return 0;
+	}
+	return 1;
+}
+
+struct explodomatica_bank *explodomatica_bank_open(const char *filename)
+{
+	struct explodomatica_bank *b;
+	struct stat st;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "explodomatica: Cannot open '%s': %s\n",
+			filename, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(struct bank_header)) {
+		fprintf(stderr, "explodomatica: '%s' is not an explosion bank\n",
+			filename);
+		close(fd);
+		return NULL;
+	}
+	b = malloc(sizeof(*b));
+	if (!b)
+		out_of_memory(sizeof(*b));
+	b->size = st.st_size;
+	b->map = mmap(NULL, b->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (b->map == MAP_FAILED) {
+		fprintf(stderr, "explodomatica: Cannot map '%s': %s\n",
+			filename, strerror(errno));
+		free(b);
+		return NULL;
+	}
+	b->h = b->map;
+	b->entry = (struct bank_entry *) (b->h + 1);
+	if (!bank_valid(b)) {
+		fprintf(stderr, "explodomatica: '%s' is not an explosion bank, "
+			"or was made by another version or machine\n", filename);
+		explodomatica_bank_close(b);
+		return NULL;
+	}
+	return b;
+}
+
+void explodomatica_bank_close(struct explodomatica_bank *b)
+{
+	if (!b)
+		return;
+	munmap(b->map, b->size);
+	free(b);
+}
+
+int explodomatica_bank_count(struct explodomatica_bank *b)
+{
+	return b->h->nvariants;
+}
+
+int explodomatica_bank_format(struct explodomatica_bank *b)
+{
+	return b->h->format;
+}
+
+const void *explodomatica_bank_samples(struct explodomatica_bank *b,
+		int variant, int *nsamples)
+{
+	*nsamples = 0;
+	if (variant < 0 || variant >= (int) b->h->nvariants ||
+			!b->entry[variant].offset)
+		return NULL;
+	*nsamples = b->entry[variant].nsamples;
+	return (const char *) b->map + b->entry[variant].offset;
+}
+
+/* Sets file to the bank's string at offset.  Data read from some other
+ * file is forgotten, for explodomatica() to read this one.
+ */
+static void bank_file(struct explodomatica_bank *b, uint32_t offset,
+		char *file, sample_t **data, unsigned long long *nsamples)
+{
+	const char *str = (const char *) b->map + b->h->strings + offset;
+
+	if (strcmp(file, str) == 0)
+		return;
+	snprintf(file, PATH_MAX + 1, "%s", str);
+	*data = NULL;
+	*nsamples = 0;
+}
+
+int explodomatica_bank_params(struct explodomatica_bank *b, int variant,
+		struct explosion_def *e)
+{
+	struct bank_entry *v;
+
+	if (variant < 0 || variant >= (int) b->h->nvariants)
+		return -1;
+	v = &b->entry[variant];
+	e->seed = v->seed;
+	e->duration = v->duration;
+	e->preexplosion_delay = v->preexplosion_delay;
+	e->preexplosion_low_pass_factor = v->preexplosion_low_pass_factor;
+	e->final_speed_factor = v->final_speed_factor;
+	e->nlayers = v->nlayers;
+	e->preexplosions = v->preexplosions;
+	e->preexplosion_lp_iters = v->preexplosion_lp_iters;
+	e->reverb_early_refls = v->reverb_early_refls;
+	e->reverb_late_refls = v->reverb_late_refls;
+	e->reverb = v->reverb;
+	e->reverb_compat = v->reverb_compat;
+	e->lowpass_biquad = v->lowpass_biquad;
+	e->resample_sinc = v->resample_sinc;
+	bank_file(b, v->input_file, e->input_file,
+		&e->input_data, &e->input_samples);
+	bank_file(b, v->reverb_ir_file, e->reverb_ir_file,
+		&e->ir_data, &e->ir_samples);
+	return 0;
+}
+
+/* About how much of the arena rendering *e will need, in bytes */
+static size_t render_bytes(struct explosion_def *e)
+{
+	size_t bytes, n;
+	int dry;
+
+	/* streaming needs little, and how much is left to the first render */
+	if (e->stream)
+		return 0;
+	bytes = make_explosions_bytes(e);
+	dry = (int) (seconds_to_frames(e->duration) / e->final_speed_factor);
+	bytes += sound_bytes(dry) + arena_bytes(resampler_bytes(
+			seconds_to_frames(e->duration), e->final_speed_factor,
+			e->resample_sinc));
+	if (e->reverb && e->ir_data && e->ir_samples > 0) {
+		n = (dry + e->ir_samples - 1 + CONV_BLOCK - 1) / CONV_BLOCK;
+		bytes += sound_bytes(n * CONV_BLOCK) + conv_reverb_bytes(e, CONV_BLOCK);
+	} else if (e->reverb) {
+		bytes += sound_bytes(dry * 2) + tap_reverb_bytes(e);
+	} else {
+		bytes += sound_bytes(dry);
+	}
+	return bytes;
+}
+
+/* Fills in the totals of *st, and hands it to the caller, if wanted */
+static void finish_stats(struct explodomatica_context *ctx,
+		struct explosion_def *e, struct explodomatica_stats *st,
+		double start)
+{
+	st->total_seconds = stats_clock() - start;
+	st->allocs = ctx->render_allocs;
+	st->heap_allocs = ctx->render_heap_allocs;
+	st->alloc_bytes = ctx->render_bytes;
+	st->peak_bytes = ctx->render_peak;
+	st->largest_alloc = ctx->render_largest;
+	if (e->stats)
+		*e->stats = *st;
+}
+
+int explodomatica_format_stats(struct explodomatica_stats *st,
+		char *buf, int len)
+{
+	return snprintf(buf, len,
+		"Render stats%s:\n"
+		"  pre-explosions  %8.3f secs\n"
+		"  explosion       %8.3f secs\n"
+		"  speed change    %8.3f secs\n"
+		"  reverb          %8.3f secs\n"
+		"  save            %8.3f secs\n"
+		"  total           %8.3f secs\n"
+		"  %llu samples made\n"
+		"  %lu allocations, %lu from the heap, %llu bytes\n"
+		"  %llu bytes peak, largest buffer %llu bytes\n",
+		st->cancelled ? " (cancelled)" : st->cached ? " (cached)" :
+			st->streamed ? " (streamed)" : "",
+		st->preexplosion_seconds, st->explosion_seconds,
+		st->speed_change_seconds, st->reverb_seconds,
+		st->save_seconds, st->total_seconds, st->samples,
+		st->allocs, st->heap_allocs, st->alloc_bytes,
+		st->peak_bytes, st->largest_alloc);
+}
+
+static struct sound *render_explosion(struct explodomatica_context *ctx,
+		struct explosion_def *e)
 {
+	struct explodomatica_stats st;
 	struct sound *pe, *s, *s2;
+	double start, t;
 
-	if (e->input_file && strcmp(e->input_file, "") != 0)
-		read_input_file(e->input_file, &e->input_data, &e->input_samples);
+	memset(&st, 0, sizeof(st));
+	start = stats_clock();
+	if (explodomatica_load_input(e) != 0)
+		return NULL;
 
-	pe = make_preexplosions(e);
+	if (e->seed >= 0)
+		explodomatica_seed(e, (unsigned long long) e->seed);
+	/* Not seeded?  Seed from libc's generator, so srand() still works. */
+	if (!e->rng[0] && !e->rng[1] && !e->rng[2] && !e->rng[3])
+		explodomatica_seed(e, (unsigned long long) rand());
+
+	arena_reset(ctx, render_bytes(e));
+
+	if (e->stream) {
+		s2 = stream_explodomatica(ctx, e);
+		st.streamed = 1;
+		st.cancelled = !s2;
+		st.samples = s2 ? s2->nsamples : 0;
+		finish_stats(ctx, e, &st, start);
+		return s2;
+	}
 
-	if (!e->reverb && explodomatica_progress)
-		*explodomatica_progress = 0.33;	
-	
-	s = make_explosion(e, e->duration, e->nlayers);
-	if (!e->reverb && explodomatica_progress)
-		*explodomatica_progress = 0.5;	
+	/* Without a seed the output is not repeatable, so don't cache it */
+	if (strcmp(e->cache_dir, "") != 0 && e->seed >= 0) {
+		s2 = cache_lookup(ctx, e);
+		if (s2) {
+			say(e, "Using cached explosion\n");
+			st.cached = 1;
+			t = stats_clock();
+			goto finished;
+		}
+	}
+
+	/* The reverb, when wanted, takes most of the time */
+	pe = NULL;
+	begin_stage(ctx, e, 0.0, e->reverb ? 0.3 : 0.8);
+	s = make_explosions(ctx, e, &pe, &st);
+	if (!s)
+		goto cancelled;
 	if (pe) {
-		accumulate_sound(s, pe);
-		renormalize(s);
+		t = stats_clock();
+		accumulate_and_renormalize(s, pe);
+		st.explosion_seconds += stats_clock() - t;
 	}
-	if (!e->reverb && explodomatica_progress)
-		*explodomatica_progress = 0.8;	
-	change_speed_inplace(s, e->final_speed_factor);
+	t = stats_clock();
+	begin_stage(ctx, e, e->reverb ? 0.3 : 0.8, e->reverb ? 0.35 : 0.95);
+	s = change_speed(ctx, e, s, e->final_speed_factor);
+	if (cancelled(e))
+		goto cancelled;
 	trim_trailing_silence(s);
+	st.speed_change_seconds = stats_clock() - t;
+	st.samples += s->nsamples;
+	t = stats_clock();
 	if (e->reverb) {
-		s2 = poor_mans_reverb(s, e->reverb_early_refls, e->reverb_late_refls);
+		begin_stage(ctx, e, 0.35, 0.95);
+		if (e->ir_data && e->ir_samples > 0)
+			s2 = convolution_reverb(ctx, e, s);
+		else
+			s2 = poor_mans_reverb(ctx, e, s);
+		if (cancelled(e))
+			goto cancelled;
 		trim_trailing_silence(s2);
+		st.reverb_seconds = stats_clock() - t;
+		st.samples += s2->nsamples;
 	} else {
-		s2 = copy_sound(s);
-		if (!e->reverb && explodomatica_progress)
-			*explodomatica_progress = 0.9;	
+		s2 = copy_sound(ctx, s);
 	}
+	report_progress(e, 0.95);
 
-	if (strcmp(e->save_filename, "") != 0)
-		explodomatica_save_file(e->save_filename, s2, 1);
+	t = stats_clock();
+	if (strcmp(e->cache_dir, "") != 0 && e->seed >= 0)
+		cache_store(e, s2);
 
-	if (explodomatica_progress)
-		*explodomatica_progress = 1.0;	
-	free_sound(s);
-	free_sound(pe);
+finished:
+	if (strcmp(e->save_filename, "") != 0 &&
+		save_sound(e->save_filename, s2, 1,
+			SF_FORMAT_WAV | SF_FORMAT_PCM_16) == 0)
+		say(e, "Saved output in '%s'\n", e->save_filename);
+	st.save_seconds = stats_clock() - t;
+
+	report_progress(e, 1.0);
+	finish_stats(ctx, e, &st, start);
 	return s2;
+
+cancelled:
+	report_progress(e, 0.0);
+	st.cancelled = 1;
+	finish_stats(ctx, e, &st, start);
+	return NULL;
 }
 
-void explodomatica_progress_variable(volatile float *progress)
+/* explodomatica() without a context of the caller's renders in this one,
+ * made when first needed and then kept, arena, layer threads and all, so
+ * that one-off callers don't start and stop a pool of threads for every
+ * explosion.  While it is busy, other such calls render in a context made
+ * for the occasion, which makes its layers without threads of its own.
+ */
+static pthread_mutex_t shared_context_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct explodomatica_context *shared_context;
+
+struct sound *explodomatica(struct explosion_def *e)
 {
-	explodomatica_progress = progress;
+	struct explodomatica_context *ctx;
+	struct sound *s, *copy = NULL;
+	int shared;
+
+	if (e->context)
+		return render_explosion(e->context, e);
+
+	/* Render in a context of our own, and give the caller a copy */
+	shared = pthread_mutex_trylock(&shared_context_lock) == 0;
+	if (shared) {
+		if (!shared_context)
+			shared_context = explodomatica_context_new();
+		ctx = shared_context;
+	} else {
+		ctx = explodomatica_context_new();
+		ctx->no_pool = 1;
+	}
+	s = render_explosion(ctx, e);
+	if (s) {
+		copy = malloc(sizeof(*copy));
+		if (!copy)
+			out_of_memory(sizeof(*copy));
+		copy->nsamples = s->nsamples;
+		copy->data = NULL;
+		if (s->data) {
+			copy->data = malloc(sizeof(*copy->data) * s->nsamples);
+			if (!copy->data)
+				out_of_memory(sizeof(*copy->data) * s->nsamples);
+			memcpy(copy->data, s->data, sizeof(*copy->data) * s->nsamples);
+		}
+	}
+	if (shared)
+		pthread_mutex_unlock(&shared_context_lock);
+	else
+		explodomatica_context_free(ctx);
+	return copy;
 }
 
 void *threadfunc(void *arg)
@@ -577,11 +3831,7 @@ void *threadfunc(void *arg)
 		return NULL;
 	if (!a->e)
 		return NULL;
-	if (a->e->nlayers <= 0)
-		return NULL;
-	s = explodomatica(a->e);
-	if (!s)
-		return NULL;
+	s = a->e->nlayers > 0 ? explodomatica(a->e) : NULL;
 	a->f(s, a->arg);
 	return NULL;
 }
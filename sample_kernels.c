@@ -0,0 +1,718 @@
+/*
+    (C) Copyright 2011, Stephen M. Cameron.
+
+    This file is part of explodomatica.
+
+    explodomatica is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    explodomatica is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with explodomatica; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include <limits.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+#include "explodomatica.h"
+#define DEFINE_SAMPLE_KERNELS_GLOBALS 1
+#include "sample_kernels.h"
+
+/*
+ * Scalar versions.  These are written without branches in the loops
+ * (the conditional expressions become min/max instructions) and are
+ * the reference the vector versions must match exactly, so all
+ * arithmetic is done in sample_t, as the vector versions do it.
+ */
+static void scale_clamp_scalar(sample_t *d, int n, double gain)
+{
+	int i;
+	sample_t x, g = gain;
+
+	for (i = 0; i < n; i++) {
+		x = d[i] * g;
+		x = x > 1.0 ? 1.0 : x;
+		d[i] = x < -1.0 ? -1.0 : x;
+	}
+}
+
+static void divide_scalar(sample_t *d, int n, double divisor)
+{
+	int i;
+	sample_t v = divisor;
+
+	for (i = 0; i < n; i++)
+		d[i] = d[i] / v;
+}
+
+static double peak_scalar(const sample_t *d, int n)
+{
+	int i;
+	sample_t max = 0.0, x;
+
+	for (i = 0; i < n; i++) {
+		x = fabs(d[i]);
+		max = x > max ? x : max;
+	}
+	return max;
+}
+
+static double add_peak_scalar(sample_t *acc, const sample_t *inc, int n)
+{
+	int i;
+	sample_t max = 0.0, x;
+
+	for (i = 0; i < n; i++) {
+		acc[i] += inc[i];
+		x = fabs(acc[i]);
+		max = x > max ? x : max;
+	}
+	return max;
+}
+
+static double add_divided_peak_scalar(sample_t *acc, const sample_t *inc, int n,
+		double divisor)
+{
+	int i;
+	sample_t max = 0.0, x, v = divisor;
+
+	for (i = 0; i < n; i++) {
+		acc[i] += inc[i] / v;
+		x = fabs(acc[i]);
+		max = x > max ? x : max;
+	}
+	return max;
+}
+
+static void add_n_scalar(sample_t *acc, const sample_t *const *inc, int m, int n)
+{
+	int i, j;
+	sample_t x;
+
+	for (i = 0; i < n; i++) {
+		x = acc[i];
+		for (j = 0; j < m; j++)
+			x += inc[j][i];
+		acc[i] = x;
+	}
+}
+
+/* Finishes off a dot product, from element i on, given the partial sums */
+static double dot_finish(sample_t *sum, const sample_t *a, const sample_t *b,
+		int i, int n)
+{
+	for (; i < n; i++)
+		sum[i & 7] += a[i] * b[i];
+	return ((sum[0] + sum[4]) + (sum[1] + sum[5])) +
+		((sum[2] + sum[6]) + (sum[3] + sum[7]));
+}
+
+static double dot_scalar(const sample_t *a, const sample_t *b, int n)
+{
+	sample_t sum[8] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+
+	return dot_finish(sum, a, b, 0, n);
+}
+
+static void fadeout_scalar(sample_t *d, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		d[i] *= (sample_t) 1.0 - ((sample_t) i / (sample_t) n);
+}
+
+/* A counter based generator: the counter, offset by the key's low half,
+ * goes through a 32 bit integer hash (lowbias32, by Chris Wellons), is
+ * mixed with the key's high half and hashed again.  Only 32 bit adds,
+ * multiplies, shifts and xors are used, so lanes of vectors can do it.
+ */
+#define NOISE_M1 0x7feb352dU
+#define NOISE_M2 0x846ca68bU
+#define NOISE_SCALE (1.0 / 2147483648.0)
+
+static unsigned int noise_mix(unsigned int x)
+{
+	x ^= x >> 16;
+	x *= NOISE_M1;
+	x ^= x >> 15;
+	x *= NOISE_M2;
+	x ^= x >> 16;
+	return x;
+}
+
+static sample_t noise_uniform(unsigned int k0, unsigned int k1, unsigned int c)
+{
+	return (sample_t) (int) noise_mix(noise_mix(c + k0) ^ k1) *
+		(sample_t) NOISE_SCALE;
+}
+
+static void noise_scalar(sample_t *d, int n, unsigned long long key,
+		unsigned int counter, int sum, double gain)
+{
+	unsigned int k0 = (unsigned int) key, k1 = (unsigned int) (key >> 32);
+	unsigned int c;
+	sample_t x, g = gain;
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		c = (counter + (unsigned int) i) * (unsigned int) sum;
+		x = 0.0;
+		for (j = 0; j < sum; j++)
+			x += noise_uniform(k0, k1, c + (unsigned int) j);
+		d[i] = x * g;
+	}
+}
+
+static struct sample_kernels scalar_kernels = {
+	"scalar",
+	scale_clamp_scalar,
+	divide_scalar,
+	peak_scalar,
+	add_peak_scalar,
+	add_divided_peak_scalar,
+	add_n_scalar,
+	dot_scalar,
+	fadeout_scalar,
+	noise_scalar,
+};
+
+#ifdef HAVE_X86_KERNELS
+
+/* The vector versions are written once, in terms of these, for both
+ * double and (with EXPLODOMATICA_FLOAT32) float samples.
+ */
+#ifdef EXPLODOMATICA_FLOAT32
+#define SSE_WIDTH 4
+#define sse_vec __m128
+#define sse_loadu _mm_loadu_ps
+#define sse_storeu _mm_storeu_ps
+#define sse_set1 _mm_set1_ps
+#define sse_setzero _mm_setzero_ps
+#define sse_add _mm_add_ps
+#define sse_sub _mm_sub_ps
+#define sse_mul _mm_mul_ps
+#define sse_div _mm_div_ps
+#define sse_min _mm_min_ps
+#define sse_max _mm_max_ps
+#define sse_andnot _mm_andnot_ps
+#define AVX_WIDTH 8
+#define avx_vec __m256
+#define avx_loadu _mm256_loadu_ps
+#define avx_storeu _mm256_storeu_ps
+#define avx_set1 _mm256_set1_ps
+#define avx_setzero _mm256_setzero_ps
+#define avx_add _mm256_add_ps
+#define avx_sub _mm256_sub_ps
+#define avx_mul _mm256_mul_ps
+#define avx_div _mm256_div_ps
+#define avx_min _mm256_min_ps
+#define avx_max _mm256_max_ps
+#define avx_andnot _mm256_andnot_ps
+#else
+#define SSE_WIDTH 2
+#define sse_vec __m128d
+#define sse_loadu _mm_loadu_pd
+#define sse_storeu _mm_storeu_pd
+#define sse_set1 _mm_set1_pd
+#define sse_setzero _mm_setzero_pd
+#define sse_add _mm_add_pd
+#define sse_sub _mm_sub_pd
+#define sse_mul _mm_mul_pd
+#define sse_div _mm_div_pd
+#define sse_min _mm_min_pd
+#define sse_max _mm_max_pd
+#define sse_andnot _mm_andnot_pd
+#define AVX_WIDTH 4
+#define avx_vec __m256d
+#define avx_loadu _mm256_loadu_pd
+#define avx_storeu _mm256_storeu_pd
+#define avx_set1 _mm256_set1_pd
+#define avx_setzero _mm256_setzero_pd
+#define avx_add _mm256_add_pd
+#define avx_sub _mm256_sub_pd
+#define avx_mul _mm256_mul_pd
+#define avx_div _mm256_div_pd
+#define avx_min _mm256_min_pd
+#define avx_max _mm256_max_pd
+#define avx_andnot _mm256_andnot_pd
+#endif
+
+static const sample_t ramp[] = { 0.0, 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0 };
+
+static double hmax(const sample_t *x, int n, double tail)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		tail = x[i] > tail ? x[i] : tail;
+	return tail;
+}
+
+/*
+ * SSE2 versions, 16 bytes of samples at a time.
+ */
+#define SSE2 __attribute__((target("sse2")))
+
+static SSE2 void scale_clamp_sse2(sample_t *d, int n, double gain)
+{
+	int i;
+	sse_vec g = sse_set1(gain);
+	sse_vec hi = sse_set1(1.0);
+	sse_vec lo = sse_set1(-1.0);
+	sse_vec x;
+
+	for (i = 0; i + SSE_WIDTH <= n; i += SSE_WIDTH) {
+		x = sse_mul(sse_loadu(&d[i]), g);
+		x = sse_max(sse_min(x, hi), lo);
+		sse_storeu(&d[i], x);
+	}
+	scale_clamp_scalar(&d[i], n - i, gain);
+}
+
+static SSE2 void divide_sse2(sample_t *d, int n, double divisor)
+{
+	int i;
+	sse_vec v = sse_set1(divisor);
+
+	for (i = 0; i + SSE_WIDTH <= n; i += SSE_WIDTH)
+		sse_storeu(&d[i], sse_div(sse_loadu(&d[i]), v));
+	divide_scalar(&d[i], n - i, divisor);
+}
+
+static SSE2 double peak_sse2(const sample_t *d, int n)
+{
+	int i;
+	sse_vec sign = sse_set1(-0.0);
+	sse_vec m = sse_setzero();
+	sample_t x[SSE_WIDTH];
+
+	for (i = 0; i + SSE_WIDTH <= n; i += SSE_WIDTH)
+		m = sse_max(m, sse_andnot(sign, sse_loadu(&d[i])));
+	sse_storeu(x, m);
+	return hmax(x, SSE_WIDTH, peak_scalar(&d[i], n - i));
+}
+
+static SSE2 double add_peak_sse2(sample_t *acc, const sample_t *inc, int n)
+{
+	int i;
+	sse_vec sign = sse_set1(-0.0);
+	sse_vec m = sse_setzero();
+	sse_vec v;
+	sample_t x[SSE_WIDTH];
+
+	for (i = 0; i + SSE_WIDTH <= n; i += SSE_WIDTH) {
+		v = sse_add(sse_loadu(&acc[i]), sse_loadu(&inc[i]));
+		sse_storeu(&acc[i], v);
+		m = sse_max(m, sse_andnot(sign, v));
+	}
+	sse_storeu(x, m);
+	return hmax(x, SSE_WIDTH, add_peak_scalar(&acc[i], &inc[i], n - i));
+}
+
+static SSE2 double add_divided_peak_sse2(sample_t *acc, const sample_t *inc, int n,
+		double divisor)
+{
+	int i;
+	sse_vec sign = sse_set1(-0.0);
+	sse_vec m = sse_setzero();
+	sse_vec d = sse_set1(divisor);
+	sse_vec v;
+	sample_t x[SSE_WIDTH];
+
+	for (i = 0; i + SSE_WIDTH <= n; i += SSE_WIDTH) {
+		v = sse_add(sse_loadu(&acc[i]), sse_div(sse_loadu(&inc[i]), d));
+		sse_storeu(&acc[i], v);
+		m = sse_max(m, sse_andnot(sign, v));
+	}
+	sse_storeu(x, m);
+	return hmax(x, SSE_WIDTH,
+		add_divided_peak_scalar(&acc[i], &inc[i], n - i, divisor));
+}
+
+static SSE2 void add_n_sse2(sample_t *acc, const sample_t *const *inc, int m, int n)
+{
+	int i, j;
+	sse_vec v;
+	sample_t x;
+
+	for (i = 0; i + SSE_WIDTH <= n; i += SSE_WIDTH) {
+		v = sse_loadu(&acc[i]);
+		for (j = 0; j < m; j++)
+			v = sse_add(v, sse_loadu(&inc[j][i]));
+		sse_storeu(&acc[i], v);
+	}
+	for (; i < n; i++) {
+		x = acc[i];
+		for (j = 0; j < m; j++)
+			x += inc[j][i];
+		acc[i] = x;
+	}
+}
+
+#define SSE_PER_8 (8 / SSE_WIDTH)
+
+static SSE2 double dot_sse2(const sample_t *a, const sample_t *b, int n)
+{
+	int i, v;
+	sse_vec acc[SSE_PER_8];
+	sample_t sum[8];
+
+	for (v = 0; v < SSE_PER_8; v++)
+		acc[v] = sse_setzero();
+	for (i = 0; i + 8 <= n; i += 8)
+		for (v = 0; v < SSE_PER_8; v++)
+			acc[v] = sse_add(acc[v], sse_mul(sse_loadu(&a[i + v * SSE_WIDTH]),
+						sse_loadu(&b[i + v * SSE_WIDTH])));
+	for (v = 0; v < SSE_PER_8; v++)
+		sse_storeu(&sum[v * SSE_WIDTH], acc[v]);
+	return dot_finish(sum, a, b, i, n);
+}
+
+static SSE2 void fadeout_sse2(sample_t *d, int n)
+{
+	int i;
+	sse_vec one = sse_set1(1.0);
+	sse_vec step = sse_set1(SSE_WIDTH);
+	sse_vec vn = sse_set1((sample_t) n);
+	sse_vec idx = sse_loadu(ramp);
+	sse_vec f;
+
+	for (i = 0; i + SSE_WIDTH <= n; i += SSE_WIDTH) {
+		f = sse_sub(one, sse_div(idx, vn));
+		sse_storeu(&d[i], sse_mul(sse_loadu(&d[i]), f));
+		idx = sse_add(idx, step);
+	}
+	for (; i < n; i++)
+		d[i] *= (sample_t) 1.0 - ((sample_t) i / (sample_t) n);
+}
+
+/* SSE2 has no 32 bit multiply keeping the low halves, so make one */
+static SSE2 __m128i mullo32_sse2(__m128i a, __m128i b)
+{
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+				_mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static SSE2 __m128i noise_mix_sse2(__m128i x)
+{
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+	x = mullo32_sse2(x, _mm_set1_epi32((int) NOISE_M1));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+	x = mullo32_sse2(x, _mm_set1_epi32((int) NOISE_M2));
+	return _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+}
+
+/* 4 samples at a time, which is 1 or 2 vectors of them */
+static SSE2 void noise_sse2(sample_t *d, int n, unsigned long long key,
+		unsigned int counter, int sum, double gain)
+{
+	__m128i k0 = _mm_set1_epi32((int) (unsigned int) key);
+	__m128i k1 = _mm_set1_epi32((int) (unsigned int) (key >> 32));
+	__m128i c, step, h;
+	sse_vec scale = sse_set1(NOISE_SCALE);
+	sse_vec g = sse_set1(gain);
+	sse_vec x0, x1;
+	unsigned int s = (unsigned int) sum;
+	int i, j;
+
+	c = _mm_setr_epi32((int) (counter * s), (int) ((counter + 1) * s),
+			(int) ((counter + 2) * s), (int) ((counter + 3) * s));
+	step = _mm_set1_epi32((int) (4 * s));
+	for (i = 0; i + 4 <= n; i += 4) {
+		x0 = sse_setzero();
+		x1 = sse_setzero();
+		for (j = 0; j < sum; j++) {
+			h = _mm_add_epi32(c, _mm_set1_epi32(j));
+			h = noise_mix_sse2(_mm_xor_si128(noise_mix_sse2(
+						_mm_add_epi32(h, k0)), k1));
+#ifdef EXPLODOMATICA_FLOAT32
+			x0 = sse_add(x0, sse_mul(_mm_cvtepi32_ps(h), scale));
+#else
+			x0 = sse_add(x0, sse_mul(_mm_cvtepi32_pd(h), scale));
+			x1 = sse_add(x1, sse_mul(_mm_cvtepi32_pd(
+						_mm_srli_si128(h, 8)), scale));
+#endif
+		}
+		sse_storeu(&d[i], sse_mul(x0, g));
+#ifndef EXPLODOMATICA_FLOAT32
+		sse_storeu(&d[i + 2], sse_mul(x1, g));
+#endif
+		c = _mm_add_epi32(c, step);
+	}
+	(void) x1;
+	noise_scalar(&d[i], n - i, key, counter + (unsigned int) i, sum, gain);
+}
+
+static struct sample_kernels sse2_kernels = {
+	"sse2",
+	scale_clamp_sse2,
+	divide_sse2,
+	peak_sse2,
+	add_peak_sse2,
+	add_divided_peak_sse2,
+	add_n_sse2,
+	dot_sse2,
+	fadeout_sse2,
+	noise_sse2,
+};
+
+/*
+ * AVX2 versions, 32 bytes of samples at a time.
+ */
+#define AVX2 __attribute__((target("avx2")))
+
+static AVX2 void scale_clamp_avx2(sample_t *d, int n, double gain)
+{
+	int i;
+	avx_vec g = avx_set1(gain);
+	avx_vec hi = avx_set1(1.0);
+	avx_vec lo = avx_set1(-1.0);
+	avx_vec x;
+
+	for (i = 0; i + AVX_WIDTH <= n; i += AVX_WIDTH) {
+		x = avx_mul(avx_loadu(&d[i]), g);
+		x = avx_max(avx_min(x, hi), lo);
+		avx_storeu(&d[i], x);
+	}
+	scale_clamp_scalar(&d[i], n - i, gain);
+}
+
+static AVX2 void divide_avx2(sample_t *d, int n, double divisor)
+{
+	int i;
+	avx_vec v = avx_set1(divisor);
+
+	for (i = 0; i + AVX_WIDTH <= n; i += AVX_WIDTH)
+		avx_storeu(&d[i], avx_div(avx_loadu(&d[i]), v));
+	divide_scalar(&d[i], n - i, divisor);
+}
+
+static AVX2 double peak_avx2(const sample_t *d, int n)
+{
+	int i;
+	avx_vec sign = avx_set1(-0.0);
+	avx_vec m = avx_setzero();
+	sample_t x[AVX_WIDTH];
+
+	for (i = 0; i + AVX_WIDTH <= n; i += AVX_WIDTH)
+		m = avx_max(m, avx_andnot(sign, avx_loadu(&d[i])));
+	avx_storeu(x, m);
+	return hmax(x, AVX_WIDTH, peak_scalar(&d[i], n - i));
+}
+
+static AVX2 double add_peak_avx2(sample_t *acc, const sample_t *inc, int n)
+{
+	int i;
+	avx_vec sign = avx_set1(-0.0);
+	avx_vec m = avx_setzero();
+	avx_vec v;
+	sample_t x[AVX_WIDTH];
+
+	for (i = 0; i + AVX_WIDTH <= n; i += AVX_WIDTH) {
+		v = avx_add(avx_loadu(&acc[i]), avx_loadu(&inc[i]));
+		avx_storeu(&acc[i], v);
+		m = avx_max(m, avx_andnot(sign, v));
+	}
+	avx_storeu(x, m);
+	return hmax(x, AVX_WIDTH, add_peak_scalar(&acc[i], &inc[i], n - i));
+}
+
+static AVX2 double add_divided_peak_avx2(sample_t *acc, const sample_t *inc, int n,
+		double divisor)
+{
+	int i;
+	avx_vec sign = avx_set1(-0.0);
+	avx_vec m = avx_setzero();
+	avx_vec d = avx_set1(divisor);
+	avx_vec v;
+	sample_t x[AVX_WIDTH];
+
+	for (i = 0; i + AVX_WIDTH <= n; i += AVX_WIDTH) {
+		v = avx_add(avx_loadu(&acc[i]), avx_div(avx_loadu(&inc[i]), d));
+		avx_storeu(&acc[i], v);
+		m = avx_max(m, avx_andnot(sign, v));
+	}
+	avx_storeu(x, m);
+	return hmax(x, AVX_WIDTH,
+		add_divided_peak_scalar(&acc[i], &inc[i], n - i, divisor));
+}
+
+static AVX2 void add_n_avx2(sample_t *acc, const sample_t *const *inc, int m, int n)
+{
+	int i, j;
+	avx_vec v;
+	sample_t x;
+
+	for (i = 0; i + AVX_WIDTH <= n; i += AVX_WIDTH) {
+		v = avx_loadu(&acc[i]);
+		for (j = 0; j < m; j++)
+			v = avx_add(v, avx_loadu(&inc[j][i]));
+		avx_storeu(&acc[i], v);
+	}
+	for (; i < n; i++) {
+		x = acc[i];
+		for (j = 0; j < m; j++)
+			x += inc[j][i];
+		acc[i] = x;
+	}
+}
+
+#define AVX_PER_8 (8 / AVX_WIDTH)
+
+static AVX2 double dot_avx2(const sample_t *a, const sample_t *b, int n)
+{
+	int i, v;
+	avx_vec acc[AVX_PER_8];
+	sample_t sum[8];
+
+	for (v = 0; v < AVX_PER_8; v++)
+		acc[v] = avx_setzero();
+	for (i = 0; i + 8 <= n; i += 8)
+		for (v = 0; v < AVX_PER_8; v++)
+			acc[v] = avx_add(acc[v], avx_mul(avx_loadu(&a[i + v * AVX_WIDTH]),
+						avx_loadu(&b[i + v * AVX_WIDTH])));
+	for (v = 0; v < AVX_PER_8; v++)
+		avx_storeu(&sum[v * AVX_WIDTH], acc[v]);
+	return dot_finish(sum, a, b, i, n);
+}
+
+static AVX2 void fadeout_avx2(sample_t *d, int n)
+{
+	int i;
+	avx_vec one = avx_set1(1.0);
+	avx_vec step = avx_set1(AVX_WIDTH);
+	avx_vec vn = avx_set1((sample_t) n);
+	avx_vec idx = avx_loadu(ramp);
+	avx_vec f;
+
+	for (i = 0; i + AVX_WIDTH <= n; i += AVX_WIDTH) {
+		f = avx_sub(one, avx_div(idx, vn));
+		avx_storeu(&d[i], avx_mul(avx_loadu(&d[i]), f));
+		idx = avx_add(idx, step);
+	}
+	for (; i < n; i++)
+		d[i] *= (sample_t) 1.0 - ((sample_t) i / (sample_t) n);
+}
+
+static AVX2 __m256i noise_mix_avx2(__m256i x)
+{
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+	x = _mm256_mullo_epi32(x, _mm256_set1_epi32((int) NOISE_M1));
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 15));
+	x = _mm256_mullo_epi32(x, _mm256_set1_epi32((int) NOISE_M2));
+	return _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+}
+
+/* 8 samples at a time, which is 1 or 2 vectors of them */
+static AVX2 void noise_avx2(sample_t *d, int n, unsigned long long key,
+		unsigned int counter, int sum, double gain)
+{
+	__m256i k0 = _mm256_set1_epi32((int) (unsigned int) key);
+	__m256i k1 = _mm256_set1_epi32((int) (unsigned int) (key >> 32));
+	__m256i c, step, h;
+	avx_vec scale = avx_set1(NOISE_SCALE);
+	avx_vec g = avx_set1(gain);
+	avx_vec x0, x1;
+	unsigned int s = (unsigned int) sum;
+	int i, j;
+
+	c = _mm256_mullo_epi32(_mm256_add_epi32(_mm256_set1_epi32((int) counter),
+				_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)),
+			_mm256_set1_epi32((int) s));
+	step = _mm256_set1_epi32((int) (8 * s));
+	for (i = 0; i + 8 <= n; i += 8) {
+		x0 = avx_setzero();
+		x1 = avx_setzero();
+		for (j = 0; j < sum; j++) {
+			h = _mm256_add_epi32(c, _mm256_set1_epi32(j));
+			h = noise_mix_avx2(_mm256_xor_si256(noise_mix_avx2(
+						_mm256_add_epi32(h, k0)), k1));
+#ifdef EXPLODOMATICA_FLOAT32
+			x0 = avx_add(x0, avx_mul(_mm256_cvtepi32_ps(h), scale));
+#else
+			x0 = avx_add(x0, avx_mul(_mm256_cvtepi32_pd(
+						_mm256_castsi256_si128(h)), scale));
+			x1 = avx_add(x1, avx_mul(_mm256_cvtepi32_pd(
+						_mm256_extracti128_si256(h, 1)), scale));
+#endif
+		}
+		avx_storeu(&d[i], avx_mul(x0, g));
+#ifndef EXPLODOMATICA_FLOAT32
+		avx_storeu(&d[i + 4], avx_mul(x1, g));
+#endif
+		c = _mm256_add_epi32(c, step);
+	}
+	(void) x1;
+	noise_scalar(&d[i], n - i, key, counter + (unsigned int) i, sum, gain);
+}
+
+static struct sample_kernels avx2_kernels = {
+	"avx2",
+	scale_clamp_avx2,
+	divide_avx2,
+	peak_avx2,
+	add_peak_avx2,
+	add_divided_peak_avx2,
+	add_n_avx2,
+	dot_avx2,
+	fadeout_avx2,
+	noise_avx2,
+};
+
+#endif /* HAVE_X86_KERNELS */
+
+static struct sample_kernels *chosen_kernels = &scalar_kernels;
+static pthread_once_t choose_once = PTHREAD_ONCE_INIT;
+
+static void choose_kernels(void)
+{
+	char *want = getenv("EXPLODOMATICA_KERNELS");
+
+	chosen_kernels = &scalar_kernels;
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		chosen_kernels = &sse2_kernels;
+	if (__builtin_cpu_supports("avx2"))
+		chosen_kernels = &avx2_kernels;
+	if (want && strcmp(want, "sse2") == 0 && __builtin_cpu_supports("sse2"))
+		chosen_kernels = &sse2_kernels;
+#endif
+	if (want && strcmp(want, "scalar") == 0)
+		chosen_kernels = &scalar_kernels;
+}
+
+struct sample_kernels *sample_kernels(void)
+{
+	pthread_once(&choose_once, choose_kernels);
+	return chosen_kernels;
+}
+
+sample_t sample_noise(unsigned long long key, unsigned int counter,
+		int sum, double gain)
+{
+	sample_t x;
+
+	noise_scalar(&x, 1, key, counter, sum, gain);
+	return x;
+}
@@ -0,0 +1,95 @@
+#ifndef __SAMPLE_KERNELS_H__
+#define __SAMPLE_KERNELS_H__
+/*
+    (C) Copyright 2011, Stephen M. Cameron.
+
+    This file is part of explodomatica.
+
+    explodomatica is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    explodomatica is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with explodomatica; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+ */
+
+#undef GLOBAL
+#ifdef DEFINE_SAMPLE_KERNELS_GLOBALS
+#define GLOBAL
+#else
+#define GLOBAL extern
+#endif
+
+/* Needs sample_t from explodomatica.h */
+
+/* Inner loops over sample buffers.  There are scalar, SSE2 and AVX2
+ * versions of each, and the best one the CPU supports is picked the
+ * first time sample_kernels() is called.  All versions give bit for
+ * bit the same results.  Setting the environment variable
+ * EXPLODOMATICA_KERNELS to "scalar", "sse2" or "avx2" forces a choice
+ * (if the CPU supports it.)
+ */
+struct sample_kernels {
+	const char *name;
+
+	/* d[i] = d[i] * gain, clamped to [-1.0, 1.0] */
+	void (*scale_clamp)(sample_t *d, int n, double gain);
+
+	/* d[i] = d[i] / divisor */
+	void (*divide)(sample_t *d, int n, double divisor);
+
+	/* returns the largest fabs(d[i]) */
+	double (*peak)(const sample_t *d, int n);
+
+	/* acc[i] += inc[i], returns the largest fabs(acc[i]) afterwards */
+	double (*add_peak)(sample_t *acc, const sample_t *inc, int n);
+
+	/* acc[i] += inc[i] / divisor, returns the largest fabs(acc[i])
+	 * afterwards
+	 */
+	double (*add_divided_peak)(sample_t *acc, const sample_t *inc, int n,
+			double divisor);
+
+	/* acc[i] += inc[0][i] + inc[1][i] + ... + inc[m - 1][i], added
+	 * one at a time in that order, in a single pass over acc
+	 */
+	void (*add_n)(sample_t *acc, const sample_t *const *inc, int m, int n);
+
+	/* returns the sum of a[i] * b[i].  The products are summed into
+	 * 8 partial sums, product i into sum i % 8, which are then added
+	 * together in a fixed order.
+	 */
+	double (*dot)(const sample_t *a, const sample_t *b, int n);
+
+	/* d[i] *= 1.0 - i / n, a linear fade out over n samples */
+	void (*fadeout)(sample_t *d, int n);
+
+	/* d[i] = gain * (u[c * sum] + ... + u[c * sum + sum - 1]), where
+	 * c = counter + i, added in that order.  u[j] is a random number
+	 * in [-1.0, 1.0) made by hashing j with key, so any stretch of
+	 * the noise can be made without making what comes before it.
+	 * sum = 1 gives uniform noise, larger sums get closer to gaussian.
+	 */
+	void (*noise)(sample_t *d, int n, unsigned long long key,
+			unsigned int counter, int sum, double gain);
+};
+
+GLOBAL struct sample_kernels *sample_kernels(void);
+
+/* Scalar counterpart of the noise kernel: the sample it would make at
+ * counter, for when samples are wanted one at a time; cheaper than a
+ * call to the kernel for each.
+ */
+GLOBAL sample_t sample_noise(unsigned long long key, unsigned int counter,
+		int sum, double gain);
+
+#undef GLOBAL
+#endif
@@ -24,11 +24,17 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <limits.h>
+#include <math.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define WWVIAUDIO_DEFINE_GLOBALS
 #include "wwviaudio.h"
@@ -39,13 +45,19 @@
 
 #define FRAMES_PER_BUFFER  (1024)
 
+/* What a sample of the music, or of a sound effect, is multiplied by */
+#define MUSIC_GAIN (0.5f / (float) INT16_MAX)
+#define EFFECT_GAIN (0.25f / (float) INT16_MAX)
+
 static PaStream *stream = NULL;
 static int audio_paused = 0;
 static int music_playing = 1;
 static int sound_working = 0;
+static int mixer_running = 0;	/* patestCallback() is being called, atomic */
 static int nomusic = 0;
 static int sound_effects_on = 1;
 static int sound_device = -1; /* default sound device for port audio. */
+static int output_channels = 2;
 static unsigned int max_concurrent_sounds = 0;
 static int max_sound_clips = 0;
 
@@ -101,21 +113,297 @@ void wwviaudio_set_nomusic(void)
 }
 
 static struct sound_clip {
+	int nsamples;
+	int16_t *sample;
+	int borrowed;	/* sample belongs to the caller, don't free() it */
+	int limit;	/* most sounds playing it at once, 0: no limit */
+	int playing;	/* sounds playing it, as far as the game threads know */
+} *clip = NULL;
+
+/* A slot of the mixer.  Only the mixer, patestCallback(), touches these.
+ * The slots with sounds playing are listed, in no particular order, in
+ * the first nactive entries of active_voice[], so that the mixer need
+ * not look at the idle ones.
+ */
+static struct voice {
 	int active;
 	int nsamples;
 	int pos;
 	int16_t *sample;
-} *clip = NULL;
+	float gain;
+	uint64_t param;		/* the voice_param[] gain and weight[] are for */
+	float weight[WWVIAUDIO_MAX_CHANNELS];	/* on each output channel */
+	unsigned int serial;	/* of the sound playing */
+	unsigned int index;	/* in active_voice[], if active */
+} *audio_queue = NULL;
+
+static unsigned int *active_voice = NULL;
+static unsigned int nactive = 0;
+
+/* Each output channel is mixed on its own, FRAMES_PER_BUFFER floats
+ * apiece, then interleaved into portaudio's buffer.
+ */
+static float *mix_buffer = NULL;
 
-static struct sound_clip *audio_queue = NULL;
+/* Each slot's gain and pan, packed by pack_param().  The game threads
+ * change them with atomic stores, taking no lock, and the mixer picks
+ * them up at the start of each buffer, moving the voice from its old
+ * gain and pan to the new over the buffer, so that they never jump.
+ */
+static uint64_t *voice_param = NULL;
+
+static uint64_t pack_param(float gain, float pan)
+{
+	uint32_t g, p;
+
+	memcpy(&g, &gain, sizeof(g));
+	memcpy(&p, &pan, sizeof(p));
+	return (uint64_t) g << 32 | p;
+}
+
+static void unpack_param(uint64_t param, float *gain, float *pan)
+{
+	uint32_t g = (uint32_t) (param >> 32), p = (uint32_t) param;
+
+	memcpy(gain, &g, sizeof(*gain));
+	memcpy(pan, &p, sizeof(*pan));
+}
+
+/* How much of a voice with the given gain and pan goes to each output
+ * channel.  The channels are taken to be in a row, left to right, and
+ * the voice is panned between the two it falls between, keeping its
+ * power the same wherever it is.
+ */
+static void pan_weights(float gain, float pan, float *weight)
+{
+	float x, f;
+	int c;
+
+	memset(weight, 0, sizeof(*weight) * output_channels);
+	if (output_channels == 1) {
+		weight[0] = gain;
+		return;
+	}
+	if (pan < -1.0f)
+		pan = -1.0f;
+	if (pan > 1.0f)
+		pan = 1.0f;
+	x = (pan + 1.0f) * 0.5f * (float) (output_channels - 1);
+	c = (int) x;
+	if (c > output_channels - 2)
+		c = output_channels - 2;
+	f = x - (float) c;
+	if (f >= 1.0f) {
+		weight[c + 1] = gain;	/* cosf() wouldn't quite make the other 0 */
+		return;
+	}
+	weight[c] = gain * cosf(f * (float) M_PI * 0.5f);
+	weight[c + 1] = gain * sinf(f * (float) M_PI * 0.5f);
+}
+
+/* How loud each slot's sound was in the last buffer mixed, as a fraction
+ * of full scale.  Written only by the mixer, read by the game threads
+ * when they look for a sound to stop (see steal_slot()).
+ */
+static float *voice_level = NULL;
+
+/* Commands from the game threads to the mixer.  The game threads only
+ * ever put commands on the ring, under command_lock, and the mixer only
+ * ever takes them off, all at once at the start of each callback, so
+ * the mixer never waits for a game thread, nor sees a half made change.
+ * command_head is written only by the game threads and command_tail
+ * only by the mixer, each with a release store which the other side
+ * reads with an acquire load.
+ */
+#define COMMAND_RING_SIZE 1024	/* a power of two */
+
+#define CMD_PLAY 1
+#define CMD_CANCEL 2
+#define CMD_CANCEL_ALL 3
+
+struct command {
+	int op;
+	int slot;
+	int16_t *sample;	/* CMD_PLAY */
+	int nsamples;
+	unsigned int serial;
+};
+
+static struct command command_ring[COMMAND_RING_SIZE];
+static unsigned int command_head = 0;	/* next to fill */
+static unsigned int command_tail = 0;	/* next to take */
+static pthread_mutex_t command_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* What the game threads know of each slot, under command_lock.  Every
+ * sound started in a slot gets the next serial, and the mixer sets
+ * slot_done[] to the serial of each sound as it stops, so a slot is
+ * free once the two are the same.
+ */
+static struct slot {
+	unsigned int serial;	/* of the last sound started */
+	int16_t *sample;	/* and what it plays */
+	int clip;		/* which clip that is, -1 for none or music */
+	int priority;
+	int free;		/* on free_slot[] */
+	unsigned int cmd;	/* where its CMD_PLAY went on the command ring */
+	unsigned long long started;	/* sounds started before it */
+} *slot = NULL;
+static unsigned int *slot_done = NULL;
+static unsigned long long nstarted = 0;
+
+/* The sound effect slots known to be free, a stack, under command_lock.
+ * The mixer puts each sound effect slot it is done with on done_ring[],
+ * for reclaim_slots() to move to free_slot[], so that finding a free slot
+ * never means looking through them all.  Should done_ring[] fill up, the
+ * mixer sets done_overflow instead, and reclaim_slots() looks at every
+ * slot.  done_head is written only by the mixer, and done_tail only by
+ * the game threads.
+ */
+static unsigned int *free_slot = NULL;
+static unsigned int nfree = 0;
+static unsigned int *done_ring = NULL;
+static unsigned int done_ring_size = 0;	/* a power of two */
+static unsigned int done_head = 0;
+static unsigned int done_tail = 0;
+static int done_overflow = 0;
+
+/* Puts *c on the ring, or returns -1 if it is full.  Called with
+ * command_lock held.
+ */
+static int push_command(struct command *c)
+{
+	unsigned int tail = __atomic_load_n(&command_tail, __ATOMIC_ACQUIRE);
+
+	if (command_head - tail >= COMMAND_RING_SIZE)
+		return -1;
+	command_ring[command_head % COMMAND_RING_SIZE] = *c;
+	__atomic_store_n(&command_head, command_head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static int mixer_is_running(void)
+{
+	return __atomic_load_n(&mixer_running, __ATOMIC_ACQUIRE);
+}
+
+/* Waits until the mixer has taken every command now on the ring.
+ * Called with command_lock held, which is let go of while sleeping so
+ * as not to hold up the other game threads.
+ */
+static void wait_for_mixer(void)
+{
+	unsigned int head = command_head;
+
+	while (mixer_is_running() &&
+		(int) (__atomic_load_n(&command_tail, __ATOMIC_ACQUIRE) - head) < 0) {
+		pthread_mutex_unlock(&command_lock);
+		usleep(1000);
+		pthread_mutex_lock(&command_lock);
+	}
+}
+
+/* For commands which must not be lost to a full ring */
+static void push_command_wait(struct command *c)
+{
+	while (push_command(c) != 0 && mixer_is_running())
+		wait_for_mixer();
+}
+
+static int slot_is_free(unsigned int i)
+{
+	return __atomic_load_n(&slot_done[i], __ATOMIC_ACQUIRE) == slot[i].serial;
+}
+
+/* Puts slot i on free_slot[], if it is free and not already there.
+ * Called with command_lock held.
+ */
+static void reclaim_slot(unsigned int i)
+{
+	if (slot[i].free || !slot_is_free(i))
+		return;
+	if (slot[i].clip >= 0)
+		clip[slot[i].clip].playing--;
+	slot[i].clip = -1;
+	slot[i].free = 1;
+	free_slot[nfree++] = i;
+}
+
+/* Takes the slots the mixer is done with off done_ring[].  Called with
+ * command_lock held.
+ */
+static void reclaim_slots(void)
+{
+	unsigned int head = __atomic_load_n(&done_head, __ATOMIC_ACQUIRE);
+	unsigned int i;
+
+	for (i = done_tail; i != head; i++)
+		reclaim_slot(done_ring[i & (done_ring_size - 1)]);
+	__atomic_store_n(&done_tail, head, __ATOMIC_RELEASE);
+	if (__atomic_exchange_n(&done_overflow, 0, __ATOMIC_ACQUIRE))
+		for (i = 1; i < max_concurrent_sounds; i++)
+			reclaim_slot(i);
+}
+
+/* Stops any sound playing sample, which no clip may hold any more, and
+ * waits for the mixer to let go of it, so that it may be freed.  Called
+ * with command_lock held.
+ */
+static void forget_sample(int16_t *sample)
+{
+	struct command c;
+	unsigned int i;
+
+	if (!mixer_is_running() || sample == NULL)
+		return;
+	memset(&c, 0, sizeof(c));
+	c.op = CMD_CANCEL;
+	for (i = 0; i < max_concurrent_sounds; i++) {
+		if (slot_is_free(i) || slot[i].sample != sample)
+			continue;
+		c.slot = i;
+		push_command_wait(&c);
+	}
+	/* ...and anything already on its way, which may replace it */
+	wait_for_mixer();
+}
 
 #ifndef DATADIR
 #define DATADIR "."
 #endif
 
+/* Clips are changed one at a time, under clip_lock, since command_lock
+ * is let go of while waiting for the mixer to be done with the old one.
+ * clip_lock is always taken before command_lock.
+ */
+static pthread_mutex_t clip_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Puts sample in clip clipnum, in place of whatever was there */
+static void set_clip(int clipnum, int16_t *sample, int nsamples, int borrowed)
+{
+	int16_t *old;
+	int old_borrowed;
+
+	pthread_mutex_lock(&clip_lock);
+	pthread_mutex_lock(&command_lock);
+	/* overwriting a previously read clip, which meanwhile plays nothing */
+	old = clip[clipnum].sample;
+	old_borrowed = clip[clipnum].borrowed;
+	clip[clipnum].sample = NULL;
+	clip[clipnum].nsamples = 0;
+	forget_sample(old);
+	if (old != NULL && !old_borrowed)
+		free(old);
+	clip[clipnum].sample = sample;
+	clip[clipnum].nsamples = nsamples;
+	clip[clipnum].borrowed = borrowed;
+	pthread_mutex_unlock(&command_lock);
+	pthread_mutex_unlock(&clip_lock);
+}
+
 int wwviaudio_read_ogg_clip(int clipnum, char *filename)
 {
 	uint64_t nframes;
+	int16_t *sample = NULL;
 	char filebuf[PATH_MAX];
 	struct stat statbuf;
 	int samplesize, sample_rate;
@@ -144,13 +432,9 @@ int wwviaudio_read_ogg_clip(int clipnum, char *filename)
 	printf("sections = %d\n", sfinfo.sections);
 	printf("seekable = %d\n", sfinfo.seekable);
 */
-	if (clip[clipnum].sample != NULL)
-		/* overwriting a previously read clip... */
-		free(clip[clipnum].sample);
-
-	rc = ogg_to_pcm(filebuf, &clip[clipnum].sample, &samplesize,
+	rc = ogg_to_pcm(filebuf, &sample, &samplesize,
 		&sample_rate, &nchannels, &nframes);
-	if (clip[clipnum].sample == NULL) {
+	if (sample == NULL) {
 		printf("Can't get memory for sound data for %lu frames in %s\n",
 			nframes, filebuf);
 		goto error;
@@ -159,13 +443,11 @@ int wwviaudio_read_ogg_clip(int clipnum, char *filename)
 	if (rc != 0) {
 		fprintf(stderr, "Error: ogg_to_pcm('%s') failed.\n",
 			filebuf);
+		free(sample);
 		goto error;
 	}
 
-	clip[clipnum].nsamples = (int) nframes;
-	if (clip[clipnum].nsamples < 0)
-		clip[clipnum].nsamples = 0;
-
+	set_clip(clipnum, sample, (int) nframes < 0 ? 0 : (int) nframes, 0);
 	return 0;
 error:
 	return -1;
@@ -174,22 +456,287 @@ error:
 int wwviaudio_use_double_clip(int clipnum, double *sample, int nsamples)
 {
 	int i;
+	int16_t *s;
 
 	if (clipnum >= max_sound_clips || clipnum < 0)
 		return -1;
 
-	if (clip[clipnum].sample != NULL)
-		/* overwriting a previously read clip... */
-		free(clip[clipnum].sample);
+	s = malloc(sizeof(*s) * nsamples);
 
-	clip[clipnum].sample = malloc(sizeof(clip[clipnum].sample[0]) * nsamples);
+	for (i = 0; i < nsamples; i++) 
+		s[i] = (int16_t) (sample[i] * 32767.0); 
+	set_clip(clipnum, s, nsamples, 0);
+	return 0;
+}
+
+int wwviaudio_use_float_clip(int clipnum, float *sample, int nsamples)
+{
+	int i;
+	int16_t *s;
+
+	if (clipnum >= max_sound_clips || clipnum < 0)
+		return -1;
+
+	s = malloc(sizeof(*s) * nsamples);
 
 	for (i = 0; i < nsamples; i++) 
-		clip[clipnum].sample[i] = (int16_t) (sample[i] * 32767.0); 
-	clip[clipnum].nsamples = nsamples;
+		s[i] = (int16_t) (sample[i] * 32767.0f); 
+	set_clip(clipnum, s, nsamples, 0);
+	return 0;
+}
+
+int wwviaudio_use_int16_clip(int clipnum, int16_t *sample, int nsamples)
+{
+	if (clipnum >= max_sound_clips || clipnum < 0)
+		return -1;
+
+	/* no copy: the clip plays straight from the caller's memory */
+	set_clip(clipnum, sample, nsamples, 1);
 	return 0;
 }
 
+/* The mixer's side of the command ring and slot_done[] */
+static void voice_start(unsigned int i)
+{
+	if (audio_queue[i].active)
+		return;
+	audio_queue[i].active = 1;
+	audio_queue[i].index = nactive;
+	active_voice[nactive++] = i;
+}
+
+static void voice_done(unsigned int i)
+{
+	unsigned int last = active_voice[--nactive];
+	unsigned int tail;
+
+	active_voice[audio_queue[i].index] = last;
+	audio_queue[last].index = audio_queue[i].index;
+	audio_queue[i].active = 0;
+	__atomic_store_n(&slot_done[i], audio_queue[i].serial, __ATOMIC_RELEASE);
+	if (i == WWVIAUDIO_MUSIC_SLOT)
+		return;
+	tail = __atomic_load_n(&done_tail, __ATOMIC_ACQUIRE);
+	if (done_head - tail < done_ring_size) {
+		done_ring[done_head & (done_ring_size - 1)] = i;
+		__atomic_store_n(&done_head, done_head + 1, __ATOMIC_RELEASE);
+	} else {
+		__atomic_store_n(&done_overflow, 1, __ATOMIC_RELEASE);
+	}
+}
+
+static void run_commands(void)
+{
+	unsigned int tail = command_tail;
+	unsigned int head = __atomic_load_n(&command_head, __ATOMIC_ACQUIRE);
+	struct command *c;
+	struct voice *v;
+	float level, pan;
+
+	for (; tail != head; tail++) {
+		c = &command_ring[tail % COMMAND_RING_SIZE];
+		v = &audio_queue[c->slot];
+		switch (c->op) {
+		case CMD_PLAY:
+			v->sample = c->sample;
+			v->nsamples = c->nsamples;
+			v->pos = 0;
+			v->serial = c->serial;
+			/* a new sound starts where it is put, no need to move it */
+			v->param = __atomic_load_n(&voice_param[c->slot], __ATOMIC_RELAXED);
+			unpack_param(v->param, &v->gain, &pan);
+			pan_weights(v->gain, pan, v->weight);
+			/* not heard yet: as loud as can be, as far as anyone knows */
+			level = 1.0f;
+			__atomic_store(&voice_level[c->slot], &level, __ATOMIC_RELAXED);
+			voice_start(c->slot);
+			break;
+		case CMD_CANCEL:
+			if (v->active)
+				voice_done(c->slot);
+			break;
+		case CMD_CANCEL_ALL:
+			while (nactive > 0)
+				voice_done(active_voice[nactive - 1]);
+			break;
+		}
+	}
+	__atomic_store_n(&command_tail, tail, __ATOMIC_RELEASE);
+}
+
+/* Mixes n samples of one voice into out0, and into out1 too unless it is
+ * NULL, with gains going from g0 and g1 by dg0 and dg1 a sample:
+ * out0[i] += sample[i] * (g0 + i * dg0), and so on.  Returns the largest
+ * magnitude of the samples, saturated to INT16_MAX.
+ */
+static int mix_voice(float *out0, float *out1, const int16_t *sample, int n,
+	float g0, float dg0, float g1, float dg1)
+{
+	int i = 0, peak = 0;
+#if defined(__SSE2__)
+	__m128 ramp = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+	__m128 a = _mm_add_ps(_mm_set1_ps(g0), _mm_mul_ps(ramp, _mm_set1_ps(dg0)));
+	__m128 b = _mm_add_ps(_mm_set1_ps(g1), _mm_mul_ps(ramp, _mm_set1_ps(dg1)));
+	__m128 da = _mm_set1_ps(4.0f * dg0), db = _mm_set1_ps(4.0f * dg1);
+	__m128i x, hi16 = _mm_setzero_si128(), lo16 = _mm_setzero_si128();
+	__m128 lo, hi;
+	int16_t p[8], q[8];
+	int k;
+
+/* sign extend each int16 into the top of an int32, and shift down */
+#define LOAD_SAMPLES \
+		x = _mm_loadu_si128((const __m128i *) &sample[i]); \
+		hi16 = _mm_max_epi16(hi16, x); \
+		lo16 = _mm_min_epi16(lo16, x); \
+		lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16)); \
+		hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+#define MIX_SAMPLES(out, g) \
+		_mm_storeu_ps(&out[i], _mm_add_ps(_mm_loadu_ps(&out[i]), _mm_mul_ps(lo, g))); \
+		_mm_storeu_ps(&out[i + 4], \
+			_mm_add_ps(_mm_loadu_ps(&out[i + 4]), _mm_mul_ps(hi, g)));
+#define RAMP_SAMPLES(out, g, dg) \
+		_mm_storeu_ps(&out[i], _mm_add_ps(_mm_loadu_ps(&out[i]), _mm_mul_ps(lo, g))); \
+		g = _mm_add_ps(g, dg); \
+		_mm_storeu_ps(&out[i + 4], \
+			_mm_add_ps(_mm_loadu_ps(&out[i + 4]), _mm_mul_ps(hi, g))); \
+		g = _mm_add_ps(g, dg);
+
+	/* The gains only change in the buffers in which the game moves the
+	 * sound, and stepping them holds up every sample, so they are only
+	 * stepped when they must be.
+	 */
+	if (out1 == NULL && dg0 == 0.0f) {
+		for (; i + 8 <= n; i += 8) {
+			LOAD_SAMPLES
+			MIX_SAMPLES(out0, a)
+		}
+	} else if (out1 == NULL) {
+		for (; i + 8 <= n; i += 8) {
+			LOAD_SAMPLES
+			RAMP_SAMPLES(out0, a, da)
+		}
+	} else if (dg0 == 0.0f && dg1 == 0.0f) {
+		for (; i + 8 <= n; i += 8) {
+			LOAD_SAMPLES
+			MIX_SAMPLES(out0, a)
+			MIX_SAMPLES(out1, b)
+		}
+	} else {
+		for (; i + 8 <= n; i += 8) {
+			LOAD_SAMPLES
+			RAMP_SAMPLES(out0, a, da)
+			RAMP_SAMPLES(out1, b, db)
+		}
+	}
+#undef LOAD_SAMPLES
+#undef MIX_SAMPLES
+#undef RAMP_SAMPLES
+	_mm_storeu_si128((__m128i *) p, hi16);
+	_mm_storeu_si128((__m128i *) q, lo16);
+	for (k = 0; k < 8; k++) {
+		if (p[k] > peak)
+			peak = p[k];
+		if (-q[k] > peak)
+			peak = -q[k];
+	}
+#endif
+	for (; i < n; i++) {
+		out0[i] += (float) sample[i] * (g0 + (float) i * dg0);
+		if (out1 != NULL)
+			out1[i] += (float) sample[i] * (g1 + (float) i * dg1);
+		if (abs(sample[i]) > peak)
+			peak = abs(sample[i]);
+	}
+	return peak > INT16_MAX ? INT16_MAX : peak;
+}
+
+/* Copies the frames mixed in mix_buffer[] to out, interleaved */
+static void interleave(float *out, int frames)
+{
+	int i = 0, c;
+#if defined(__SSE2__)
+	__m128 l, r;
+
+	for (; output_channels == 2 && i + 4 <= frames; i += 4) {
+		l = _mm_loadu_ps(&mix_buffer[i]);
+		r = _mm_loadu_ps(&mix_buffer[FRAMES_PER_BUFFER + i]);
+		_mm_storeu_ps(&out[2 * i], _mm_unpacklo_ps(l, r));
+		_mm_storeu_ps(&out[2 * i + 4], _mm_unpackhi_ps(l, r));
+	}
+#endif
+	for (; i < frames; i++)
+		for (c = 0; c < output_channels; c++)
+			out[i * output_channels + c] = mix_buffer[c * FRAMES_PER_BUFFER + i];
+}
+
+/* Mixes the next frames (no more than FRAMES_PER_BUFFER) of every
+ * playing voice into out.  Each voice is mixed into the whole buffer in
+ * turn, on just the channels it is heard on, so the work done depends on
+ * the number of sounds playing, not on the number of slots.
+ */
+static void mix_voices(float *out, int frames)
+{
+	unsigned int i, k;
+	int c, n, on, nch, ch[WWVIAUDIO_MAX_CHANNELS], peak, p;
+	float level, pan, scale, ramp = 1.0f / (float) frames;
+	float target[WWVIAUDIO_MAX_CHANNELS];
+	float *mix = output_channels == 1 ? out : mix_buffer;
+	float *out0, *out1;
+	struct voice *v;
+	uint64_t param;
+
+	for (c = 0; c < output_channels; c++)
+		memset(&mix[c * FRAMES_PER_BUFFER], 0, sizeof(*mix) * frames);
+
+	for (k = 0; k < nactive; ) {
+		i = active_voice[k];
+		v = &audio_queue[i];
+		param = __atomic_load_n(&voice_param[i], __ATOMIC_RELAXED);
+		if (param != v->param) {
+			v->param = param;
+			unpack_param(param, &v->gain, &pan);
+			pan_weights(v->gain, pan, target);
+		} else {
+			memcpy(target, v->weight, sizeof(*target) * output_channels);
+		}
+		n = v->nsamples - v->pos;
+		if (n > frames)
+			n = frames;
+		on = i == WWVIAUDIO_MUSIC_SLOT ? music_playing : sound_effects_on;
+		if (on && v->sample != NULL && n > 0) {
+			scale = i == WWVIAUDIO_MUSIC_SLOT ? MUSIC_GAIN : EFFECT_GAIN;
+			/* the channels the voice is, or is going to be, heard on */
+			nch = 0;
+			for (c = 0; c < output_channels; c++)
+				if (v->weight[c] != 0.0f || target[c] != 0.0f)
+					ch[nch++] = c;
+			peak = 0;
+			for (c = 0; c < nch; c += 2) {
+				out0 = &mix[ch[c] * FRAMES_PER_BUFFER];
+				out1 = c + 1 < nch ? &mix[ch[c + 1] * FRAMES_PER_BUFFER] : NULL;
+				p = mix_voice(out0, out1, &v->sample[v->pos], n,
+					v->weight[ch[c]] * scale,
+					(target[ch[c]] - v->weight[ch[c]]) * scale * ramp,
+					out1 ? v->weight[ch[c + 1]] * scale : 0.0f,
+					out1 ? (target[ch[c + 1]] - v->weight[ch[c + 1]]) *
+						scale * ramp : 0.0f);
+				if (p > peak)
+					peak = p;
+			}
+			level = (float) peak * v->gain / (float) INT16_MAX;
+			__atomic_store(&voice_level[i], &level, __ATOMIC_RELAXED);
+		}
+		memcpy(v->weight, target, sizeof(*target) * output_channels);
+		v->pos += frames;
+		if (v->sample == NULL || v->pos >= v->nsamples)
+			voice_done(i);	/* moves another voice into active_voice[k] */
+		else
+			k++;
+	}
+	if (output_channels > 1)
+		interleave(out, frames);
+}
+
 /* This routine will be called by the PortAudio engine when audio is needed.
 ** It may called at interrupt level on some machines so don't do anything
 ** that could mess up the system like calling malloc() or free().
@@ -201,47 +748,24 @@ static int patestCallback(__attribute__ ((unused)) const void *inputBuffer,
 	__attribute__ ((unused)) PaStreamCallbackFlags statusFlags,
 	__attribute__ ((unused)) void *userData )
 {
-	unsigned int i, j;
-	int sample, count;
-	float *out = NULL;
-	float output;
-	out = (float*) outputBuffer;
+	unsigned long i, frames;
+	float *out = (float *) outputBuffer;
+
+	run_commands();
 
 	if (audio_paused) {
 		/* output silence when paused and
 		 * don't advance any sound slot pointers
 		 */
-		for (i = 0; i < framesPerBuffer; i++)
-			*out++ = (float) 0;
+		memset(out, 0, sizeof(*out) * framesPerBuffer * output_channels);
 		return 0;
 	}
 
-	for (i = 0; i < framesPerBuffer; i++) {
-		output = 0.0;
-		count = 0;
-		for (j = 0; j < max_concurrent_sounds; j++) {
-			if (!audio_queue[j].active ||
-				audio_queue[j].sample == NULL)
-				continue;
-			sample = i + audio_queue[j].pos;
-			count++;
-			if (sample >= audio_queue[j].nsamples) {
-				audio_queue[j].active = 0;
-				continue;
-			}
-			if (j != WWVIAUDIO_MUSIC_SLOT && sound_effects_on)
-				output += (float) audio_queue[j].sample[sample] * 0.5 / (float) (INT16_MAX);
-			else if (j == WWVIAUDIO_MUSIC_SLOT && music_playing)
-				output += (float) audio_queue[j].sample[sample] / (float) (INT16_MAX);
-		}
-		*out++ = (float) output / 2.0;
-        }
-	for (i = 0; i < max_concurrent_sounds; i++) {
-		if (!audio_queue[i].active)
-			continue;
-		audio_queue[i].pos += framesPerBuffer;
-		if (audio_queue[i].pos >= audio_queue[i].nsamples)
-			audio_queue[i].active = 0;
+	for (i = 0; i < framesPerBuffer; i += frames) {
+		frames = framesPerBuffer - i;
+		if (frames > FRAMES_PER_BUFFER)
+			frames = FRAMES_PER_BUFFER;
+		mix_voices(&out[i * output_channels], (int) frames);
 	}
 	return 0; /* we're never finished */
 }
@@ -262,25 +786,103 @@ static void wwviaudio_terminate_portaudio(PaError rc)
 	decode_paerror(rc);
 }
 
-int wwviaudio_initialize_portaudio(int maximum_concurrent_sounds, int maximum_sound_clips)
+/* Sets up the clip table and the mixer's slots, everything but portaudio */
+static int allocate_mixer(int maximum_concurrent_sounds, int maximum_sound_clips)
 {
-	PaStreamParameters outparams;
-	PaError rc;
-	PaDeviceIndex device_count;
+	unsigned int i;
 
 	if (maximum_concurrent_sounds < 0)
 		return -1;
 
 	max_concurrent_sounds = (unsigned int) maximum_concurrent_sounds;
 	max_sound_clips = maximum_sound_clips;
+	for (done_ring_size = 1; done_ring_size < max_concurrent_sounds; )
+		done_ring_size *= 2;
 
 	audio_queue = malloc(max_concurrent_sounds * sizeof(audio_queue[0]));
+	active_voice = malloc(max_concurrent_sounds * sizeof(active_voice[0]));
+	voice_level = malloc(max_concurrent_sounds * sizeof(voice_level[0]));
+	voice_param = malloc(max_concurrent_sounds * sizeof(voice_param[0]));
+	mix_buffer = malloc(FRAMES_PER_BUFFER * output_channels * sizeof(mix_buffer[0]));
+	slot = malloc(max_concurrent_sounds * sizeof(slot[0]));
+	slot_done = malloc(max_concurrent_sounds * sizeof(slot_done[0]));
+	free_slot = malloc(max_concurrent_sounds * sizeof(free_slot[0]));
+	done_ring = malloc(done_ring_size * sizeof(done_ring[0]));
 	clip = malloc(max_sound_clips * sizeof(clip[0]));
-	if (audio_queue == NULL || clip == NULL)
+	if (audio_queue == NULL || active_voice == NULL || voice_level == NULL ||
+		voice_param == NULL || mix_buffer == NULL ||
+		slot == NULL || slot_done == NULL || free_slot == NULL ||
+		done_ring == NULL || clip == NULL)
 		return -1;
 
 	memset(audio_queue, 0, sizeof(audio_queue[0]) * max_concurrent_sounds);
+	memset(voice_level, 0, sizeof(voice_level[0]) * max_concurrent_sounds);
+	for (i = 0; i < max_concurrent_sounds; i++)
+		voice_param[i] = pack_param(1.0f, 0.0f);
+	memset(slot, 0, sizeof(slot[0]) * max_concurrent_sounds);
+	memset(slot_done, 0, sizeof(slot_done[0]) * max_concurrent_sounds);
 	memset(clip, 0, sizeof(clip[0]) * max_sound_clips);
+	nactive = 0;
+	command_head = command_tail = 0;
+	done_head = done_tail = 0;
+	done_overflow = 0;
+	nstarted = 0;
+
+	/* every slot but the music's, lowest on top */
+	nfree = 0;
+	for (i = max_concurrent_sounds; i-- > 1; ) {
+		slot[i].clip = -1;
+		slot[i].free = 1;
+		free_slot[nfree++] = i;
+	}
+	if (max_concurrent_sounds > 0)
+		slot[WWVIAUDIO_MUSIC_SLOT].clip = -1;
+	return 0;
+}
+
+static void free_mixer(void)
+{
+	int i;
+
+	if (clip) {
+		for (i = 0; i < max_sound_clips; i++)
+			set_clip(i, NULL, 0, 0);
+		free(clip);
+		clip = NULL;
+		max_sound_clips = 0;
+	}
+	if (audio_queue) {
+		free(audio_queue);
+		free(active_voice);
+		free(voice_level);
+		free(voice_param);
+		free(mix_buffer);
+		free(slot);
+		free(slot_done);
+		free(free_slot);
+		free(done_ring);
+		audio_queue = NULL;
+		active_voice = NULL;
+		voice_level = NULL;
+		voice_param = NULL;
+		mix_buffer = NULL;
+		slot = NULL;
+		slot_done = NULL;
+		free_slot = NULL;
+		done_ring = NULL;
+		nfree = 0;
+		max_concurrent_sounds = 0;
+	}
+}
+
+int wwviaudio_initialize_portaudio(int maximum_concurrent_sounds, int maximum_sound_clips)
+{
+	PaStreamParameters outparams;
+	PaError rc;
+	PaDeviceIndex device_count;
+
+	if (allocate_mixer(maximum_concurrent_sounds, maximum_sound_clips) != 0)
+		return -1;
 
 	rc = Pa_Initialize();
 	if (rc != paNoError)
@@ -319,7 +921,7 @@ int wwviaudio_initialize_portaudio(int maximum_concurrent_sounds, int maximum_so
 		return -1;
 	}
 
-	outparams.channelCount = 1;                      /* mono output */
+	outparams.channelCount = output_channels;
 	outparams.sampleFormat = paFloat32;              /* 32 bit floating point output */
 	outparams.suggestedLatency =
 		Pa_GetDeviceInfo(outparams.device)->defaultLowOutputLatency;
@@ -334,6 +936,7 @@ int wwviaudio_initialize_portaudio(int maximum_concurrent_sounds, int maximum_so
 		goto error;
 	if ((rc = Pa_StartStream(stream)) != paNoError)
 		goto error;
+	__atomic_store_n(&mixer_running, 1, __ATOMIC_RELEASE);
 	return rc;
 error:
 	wwviaudio_terminate_portaudio(rc);
@@ -343,7 +946,7 @@ error:
 
 void wwviaudio_stop_portaudio(void)
 {
-	int i, rc;
+	int rc;
 	
 	if (!sound_working)
 		return;
@@ -351,27 +954,137 @@ void wwviaudio_stop_portaudio(void)
 		goto error;
 	rc = Pa_CloseStream(stream);
 error:
+	__atomic_store_n(&mixer_running, 0, __ATOMIC_RELEASE);
 	wwviaudio_terminate_portaudio(rc);
-	if (audio_queue) {
-		free(audio_queue);
-		audio_queue = NULL;
-		max_concurrent_sounds = 0;
+	free_mixer();
+	return;
+}
+
+/* Starts which_sound in which_slot.  Called with command_lock held. */
+static int start_sound(int which_sound, unsigned int which_slot)
+{
+	struct command c;
+	uint64_t old;
+
+	memset(&c, 0, sizeof(c));
+	c.op = CMD_PLAY;
+	c.slot = which_slot;
+	c.sample = clip[which_sound].sample;
+	c.nsamples = clip[which_sound].nsamples;
+	c.serial = slot[which_slot].serial + 1;
+	slot[which_slot].cmd = command_head;
+	/* the mixer picks up the sound's gain and pan as it starts it */
+	old = __atomic_exchange_n(&voice_param[which_slot], pack_param(1.0f, 0.0f),
+			__ATOMIC_RELAXED);
+	if (push_command(&c) != 0) {
+		__atomic_store_n(&voice_param[which_slot], old, __ATOMIC_RELAXED);
+		return -1;
 	}
-	if (clip) {
-		for (i = 0; i < max_sound_clips; i++) {
-			if (clip[i].sample)
-				free(clip[i].sample);
+	slot[which_slot].serial = c.serial;
+	slot[which_slot].sample = c.sample;
+	return (int) which_slot;
+}
+
+/* How loud the sound in slot i is now, as far as the game threads can
+ * tell.  tail is the mixer's command_tail.  Called with command_lock held.
+ */
+static float slot_level(unsigned int i, unsigned int tail)
+{
+	float level;
+
+	if ((int) (tail - slot[i].cmd) <= 0)
+		return 1.0f;	/* the mixer hasn't even started it */
+	__atomic_load(&voice_level[i], &level, __ATOMIC_RELAXED);
+	return level;
+}
+
+/* Picks the sound effect slot to stop for a new sound of the given
+ * priority: of the sounds playing clipnum (any clip if clipnum is -1)
+ * with no higher priority, the one of lowest priority, then the quietest,
+ * then the oldest.  A slot whose sound is over is taken first.  Returns
+ * -1 if there is none.  This looks at every slot, but is only needed
+ * when they are all in use.  Called with command_lock held.
+ */
+static int steal_slot(int clipnum, int priority)
+{
+	unsigned int tail = __atomic_load_n(&command_tail, __ATOMIC_ACQUIRE);
+	unsigned int i;
+	int best = -1;
+	float level, best_level = 0.0f;
+	struct slot *s, *b;
+
+	for (i = 1; i < max_concurrent_sounds; i++) {
+		s = &slot[i];
+		if (s->free || (clipnum >= 0 && s->clip != clipnum) ||
+			s->priority > priority)
+			continue;
+		if (slot_is_free(i))
+			return (int) i;
+		level = slot_level(i, tail);
+		if (best >= 0) {
+			b = &slot[best];
+			if (s->priority > b->priority)
+				continue;
+			if (s->priority == b->priority) {
+				if (level > best_level)
+					continue;
+				if (level == best_level && s->started > b->started)
+					continue;
+			}
 		}
-		free(clip);
-		clip = NULL;
-		max_sound_clips = 0;
+		best = (int) i;
+		best_level = level;
 	}
-	return;
+	return best;
+}
+
+/* Starts which_sound in a sound effect slot: a free one if there is one,
+ * and it is allowed another instance, otherwise one stolen from another
+ * sound (see steal_slot()).  Fails if fewer than min_free slots are free.
+ * Returns the slot, or -1.
+ */
+static int play_sound(int which_sound, int priority, unsigned int min_free)
+{
+	struct sound_clip *c;
+	int i;
+
+	if (!sound_working)
+		return 0;
+	if (which_sound < 0 || which_sound >= max_sound_clips)
+		return -1;
+
+	pthread_mutex_lock(&command_lock);
+	reclaim_slots();
+	c = &clip[which_sound];
+	if (nfree < min_free)
+		i = -1;
+	else if (c->limit > 0 && c->playing >= c->limit)
+		i = steal_slot(which_sound, priority);
+	else if (nfree > 0)
+		i = (int) free_slot[nfree - 1];
+	else
+		i = steal_slot(-1, priority);
+	if (i < 0 || start_sound(which_sound, (unsigned int) i) < 0) {
+		pthread_mutex_unlock(&command_lock);
+		return -1;
+	}
+	if (slot[i].free) {
+		nfree--;	/* it was on top */
+		slot[i].free = 0;
+	} else if (slot[i].clip >= 0) {
+		clip[slot[i].clip].playing--;
+	}
+	slot[i].clip = which_sound;
+	slot[i].priority = priority;
+	slot[i].started = nstarted++;
+	c->playing++;
+	pthread_mutex_unlock(&command_lock);
+	return i;
 }
 
 static int wwviaudio_add_sound_to_slot(int which_sound, int which_slot)
 {
-	unsigned int i;
+	int rc;
 
 	if (!sound_working)
 		return 0;
@@ -379,33 +1092,30 @@ static int wwviaudio_add_sound_to_slot(int which_sound, int which_slot)
 	if (nomusic && which_slot == WWVIAUDIO_MUSIC_SLOT)
 		return 0;
 
-	if (which_slot != WWVIAUDIO_ANY_SLOT) {
-		if (audio_queue[which_slot].active)
-			audio_queue[which_slot].active = 0;
-		audio_queue[which_slot].pos = 0;
-		audio_queue[which_slot].nsamples = 0;
-		/* would like to put a memory barrier here. */
-		audio_queue[which_slot].sample = clip[which_sound].sample;
-		audio_queue[which_slot].nsamples = clip[which_sound].nsamples;
-		/* would like to put a memory barrier here. */
-		audio_queue[which_slot].active = 1;
-		return which_slot;
-	}
-	for (i=1;i<max_concurrent_sounds;i++) {
-		if (audio_queue[i].active == 0) {
-			audio_queue[i].nsamples = clip[which_sound].nsamples;
-			audio_queue[i].pos = 0;
-			audio_queue[i].sample = clip[which_sound].sample;
-			audio_queue[i].active = 1;
-			break;
-		}
-	}
-	return (i >= max_concurrent_sounds) ? -1 : (int) i;
+	pthread_mutex_lock(&command_lock);
+	rc = start_sound(which_sound, which_slot);
+	pthread_mutex_unlock(&command_lock);
+	return rc;
 }
 
 int wwviaudio_add_sound(int which_sound)
 {
-	return wwviaudio_add_sound_to_slot(which_sound, WWVIAUDIO_ANY_SLOT);
+	return play_sound(which_sound, WWVIAUDIO_PRIORITY_NORMAL, 0);
+}
+
+int wwviaudio_add_sound_priority(int which_sound, int priority)
+{
+	return play_sound(which_sound, priority, 0);
+}
+
+int wwviaudio_set_clip_limit(int clipnum, int max_instances)
+{
+	if (clipnum >= max_sound_clips || clipnum < 0)
+		return -1;
+	pthread_mutex_lock(&command_lock);
+	clip[clipnum].limit = max_instances < 0 ? 0 : max_instances;
+	pthread_mutex_unlock(&command_lock);
+	return 0;
 }
 
 int wwviaudio_play_music(int which_sound)
@@ -416,43 +1126,57 @@ int wwviaudio_play_music(int which_sound)
 
 void wwviaudio_add_sound_low_priority(int which_sound)
 {
-
 	/* adds a sound if there are at least 5 empty sound slots. */
-	unsigned int i;
-	int empty_slots = 0;
-	int last_slot;
+	play_sound(which_sound, WWVIAUDIO_PRIORITY_LOW, 5);
+}
 
-	if (!sound_working)
-		return;
-	last_slot = -1;
-	for (i = 1; i < max_concurrent_sounds; i++)
-		if (audio_queue[i].active == 0) {
-			last_slot = i;
-			empty_slots++;
-			if (empty_slots >= 5)
-				break;
-	}
+/* Sets the gain and/or pan, whichever are not NULL, of a slot.  Takes no
+ * lock, so that it may be called as often as a game likes.
+ */
+static void set_param(int queue_entry, const float *gain, const float *pan)
+{
+	uint64_t old, new;
+	float g, p;
 
-	if (empty_slots < 5)
+	if (!sound_working || queue_entry < 0 ||
+		(unsigned int) queue_entry >= max_concurrent_sounds)
 		return;
-	
-	i = (unsigned int) last_slot;
+	old = __atomic_load_n(&voice_param[queue_entry], __ATOMIC_RELAXED);
+	do {
+		unpack_param(old, &g, &p);
+		new = pack_param(gain ? *gain : g, pan ? *pan : p);
+	} while (!__atomic_compare_exchange_n(&voice_param[queue_entry], &old, new,
+			1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
 
-	if (audio_queue[i].active == 0) {
-		audio_queue[i].nsamples = clip[which_sound].nsamples;
-		audio_queue[i].pos = 0;
-		audio_queue[i].sample = clip[which_sound].sample;
-		audio_queue[i].active = 1;
-	}
-	return;
+void wwviaudio_set_sound_gain(int queue_entry, float gain)
+{
+	set_param(queue_entry, &gain, NULL);
 }
 
+void wwviaudio_set_sound_pan(int queue_entry, float pan)
+{
+	set_param(queue_entry, NULL, &pan);
+}
+
+void wwviaudio_set_sound_gain_pan(int queue_entry, float gain, float pan)
+{
+	set_param(queue_entry, &gain, &pan);
+}
 
 void wwviaudio_cancel_sound(int queue_entry)
 {
-	if (!sound_working)
+	struct command c;
+
+	if (!sound_working || queue_entry < 0 ||
+		(unsigned int) queue_entry >= max_concurrent_sounds)
 		return;
-	audio_queue[queue_entry].active = 0;
+	memset(&c, 0, sizeof(c));
+	c.op = CMD_CANCEL;
+	c.slot = queue_entry;
+	pthread_mutex_lock(&command_lock);
+	push_command_wait(&c);
+	pthread_mutex_unlock(&command_lock);
 }
 
 void wwviaudio_cancel_music(void)
@@ -462,11 +1186,15 @@ void wwviaudio_cancel_music(void)
 
 void wwviaudio_cancel_all_sounds(void)
 {
-	unsigned int i;
+	struct command c;
+
 	if (!sound_working)
 		return;
-	for (i = 0; i < max_concurrent_sounds; i++)
-		audio_queue[i].active = 0;
+	memset(&c, 0, sizeof(c));
+	c.op = CMD_CANCEL_ALL;
+	pthread_mutex_lock(&command_lock);
+	push_command_wait(&c);
+	pthread_mutex_unlock(&command_lock);
 }
 
 int wwviaudio_set_sound_device(int device)
@@ -475,12 +1203,25 @@ int wwviaudio_set_sound_device(int device)
 	return 0;
 }
 
+int wwviaudio_set_output_channels(int channels)
+{
+	if (channels < 1 || channels > WWVIAUDIO_MAX_CHANNELS || audio_queue != NULL)
+		return -1;
+	output_channels = channels;
+	return 0;
+}
+
 #else /* stubs only... */
 
+#include <stdint.h>
+
 int wwviaudio_initialize_portaudio() { return 0; }
 void wwviaudio_stop_portaudio() { return; }
 void wwviaudio_set_nomusic() { return; }
 int wwviaudio_read_ogg_clip(int clipnum, char *filename) { return 0; }
+int wwviaudio_use_double_clip(int clipnum, double *sample, int nsamples) { return 0; }
+int wwviaudio_use_float_clip(int clipnum, float *sample, int nsamples) { return 0; }
+int wwviaudio_use_int16_clip(int clipnum, int16_t *sample, int nsamples) { return 0; }
 
 void wwviaudio_pause_audio() { return; }
 void wwviaudio_resume_audio() { return; }
@@ -495,9 +1236,15 @@ int wwviaudio_play_music(int which_sound) { return 0; }
 void wwviaudio_cancel_music() { return; }
 void wwviaudio_toggle_music() { return; }
 int wwviaudio_add_sound(int which_sound) { return 0; }
+int wwviaudio_add_sound_priority(int which_sound, int priority) { return 0; }
+int wwviaudio_set_clip_limit(int clipnum, int max_instances) { return 0; }
 void wwviaudio_add_sound_low_priority(int which_sound) { return; }
 void wwviaudio_cancel_sound(int queue_entry) { return; }
+void wwviaudio_set_sound_gain(int queue_entry, float gain) { return; }
+void wwviaudio_set_sound_pan(int queue_entry, float pan) { return; }
+void wwviaudio_set_sound_gain_pan(int queue_entry, float gain, float pan) { return; }
 void wwviaudio_cancel_all_sounds() { return; }
 int wwviaudio_set_sound_device(int device) { return 0; }
+int wwviaudio_set_output_channels(int channels) { return 0; }
 
 #endif
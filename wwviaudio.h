@@ -27,10 +27,21 @@
 #define GLOBAL extern
 #endif
 
+#include <stdint.h>
+
 #define WWVIAUDIO_MUSIC_SLOT (0)
 #define WWVIAUDIO_SAMPLE_RATE   (44100)
 #define WWVIAUDIO_ANY_SLOT (-1)
 
+/* Sound priorities, for wwviaudio_add_sound_priority().  Any int will do;
+ * these are what the other functions use.
+ */
+#define WWVIAUDIO_PRIORITY_LOW (0)
+#define WWVIAUDIO_PRIORITY_NORMAL (50)
+#define WWVIAUDIO_PRIORITY_HIGH (100)
+
+#define WWVIAUDIO_MAX_CHANNELS (8)	/* see wwviaudio_set_output_channels() */
+
 /*
  *             Configuration functions.
  */
@@ -48,6 +59,14 @@ GLOBAL void wwviaudio_set_nomusic(void);
  */
 GLOBAL int wwviaudio_set_sound_device(int device);
 
+/* Sets the number of output channels, 2 (stereo) unless this is called,
+ * up to WWVIAUDIO_MAX_CHANNELS.  Meant to be called prior to
+ * wwviaudio_initialize_portaudio.  Sounds are panned across the channels
+ * as if they were speakers in a row, left to right (see
+ * wwviaudio_set_sound_pan().)  0 is returned on success, -1 otherwise.
+ */
+GLOBAL int wwviaudio_set_output_channels(int channels);
+
 /* Initialize portaudio and start the audio engine.
  * Space will be allocated to allow for the specified
  * number of concurrently playing sounds.  The 2nd parameter
@@ -76,7 +95,20 @@ GLOBAL void wwviaudio_stop_portaudio(void);
  */
 GLOBAL int wwviaudio_read_ogg_clip(int sound_number, char *filename);
 
+/* Like wwviaudio_read_ogg_clip(), but from (copied) samples in memory.
+ * Reusing a sound number stops any channel playing the old sound, and
+ * waits, if need be, for the audio thread to be done with it.
+ */
 GLOBAL int wwviaudio_use_double_clip(int sound_number, double *sample, int nsamples);
+GLOBAL int wwviaudio_use_float_clip(int sound_number, float *sample, int nsamples);
+
+/* Like wwviaudio_use_double_clip(), but the sound plays straight from
+ * sample, which is not copied, e.g. from a memory mapped bank of
+ * explosions (see explodomatica_bank_open()).  sample must stay valid,
+ * and unchanged, until the sound number is reused or
+ * wwviaudio_stop_portaudio() is called; neither will free() it.
+ */
+GLOBAL int wwviaudio_use_int16_clip(int sound_number, int16_t *sample, int nsamples);
 
 /*
  *             Global sound control functions.
@@ -111,20 +143,43 @@ GLOBAL void wwviaudio_cancel_music(void);
 
 /*
  *             Sound effect (not music) related functions
+ *
+ * These may be called from any thread, while the audio plays.  They don't
+ * touch the channels themselves, but queue commands for the audio thread,
+ * which carries them out, in order, before it mixes the next buffer.  A
+ * channel is in use from when a sound is started on it until the audio
+ * thread finds the sound over or cancelled, or another sound takes the
+ * channel from it.  So a channel number only refers to the sound started
+ * on it for as long as that sound plays.
  */
 
-/* Begin playing a sound on a non-music channel.  The channel is returned.
- * sound_number refers to a sound previously associated with the number by
- * wwviaudio_read_ogg_clip()
+/* Begin playing a sound on a non-music channel, at the given priority.
+ * The channel is returned.  sound_number refers to a sound previously
+ * associated with the number by wwviaudio_read_ogg_clip().  If every
+ * channel is in use, the sound takes the channel of one of no higher
+ * priority, that of the lowest priority, then the quietest, then the
+ * oldest, which stops.  If there is none such, or the audio thread is too
+ * far behind with its commands, the sound is not played, and -1 is
+ * returned.
  */
+GLOBAL /* channel */ int wwviaudio_add_sound_priority(int sound_number, int priority);
+
+/* wwviaudio_add_sound_priority() at WWVIAUDIO_PRIORITY_NORMAL */
 GLOBAL /* channel */ int wwviaudio_add_sound(int sound_number);
 
-/* Begin playing a sound on a non-music channel.  The channel is returned.
- * If fewer than five channels are open, the sound is not played, and -1
- * is returned.
+/* Begin playing a sound on a non-music channel, at WWVIAUDIO_PRIORITY_LOW.
+ * If fewer than five channels are open, the sound is not played.
  */
 GLOBAL void wwviaudio_add_sound_low_priority(int sound_number);
 
+/* Limits the number of sounds playing sound_number at once to
+ * max_instances (0, the default, means no limit.)  Starting another
+ * takes the channel of one of them, as wwviaudio_add_sound_priority()
+ * would, rather than a free one.  Returns 0, or -1 if there is no such
+ * sound number.
+ */
+GLOBAL int wwviaudio_set_clip_limit(int sound_number, int max_instances);
+
 /* Silence all channels but the music channel (pointers still advance though) */
 GLOBAL void wwviaudio_silence_sound_effects(void);
 
@@ -137,6 +192,23 @@ GLOBAL void wwviaudio_toggle_sound_effects(void);
 /* Stop playing the playing buffer from the given channel */
 GLOBAL void wwviaudio_cancel_sound(int channel);
 
+/* Scale the sound playing on the given channel by gain.  Each sound
+ * starts with a gain of 1.0.
+ */
+GLOBAL void wwviaudio_set_sound_gain(int channel, float gain);
+
+/* Place the sound playing on the given channel from -1.0 (the leftmost
+ * output channel) to 1.0 (the rightmost).  Each sound starts at 0.0, in
+ * the middle.
+ *
+ * Gain and pan take no lock, and may be changed as often as you like,
+ * e.g. every frame for a moving sound; the audio thread moves each sound
+ * to its latest gain and pan smoothly over the next buffer it mixes.
+ * wwviaudio_set_sound_gain_pan() changes both at once.
+ */
+GLOBAL void wwviaudio_set_sound_pan(int channel, float pan);
+GLOBAL void wwviaudio_set_sound_gain_pan(int channel, float gain, float pan);
+
 
 /* Stop playing the playing buffer from all channels */
 GLOBAL void wwviaudio_cancel_all_sounds(void);